@@ -143,5 +143,6 @@ struct atom_app app_join_cfg = {
   "Join + Configuration",
   ATOM_ACTION_JOIN,
   init,
-  run
+  run,
+  NULL
 };
@@ -84,7 +84,8 @@ run(void *data)
   uip_ipaddr_t node_addr;
 
   /* Route for response */
-  sdn_srh_route_t route = {0};
+  atom_routing_response_t response = {0};
+  sdn_srh_route_t *route = &response.route;
 
   /* Dereference the action data */
   atom_routing_action_t *action = (atom_routing_action_t *)data;
@@ -194,7 +195,7 @@ run(void *data)
   //     + (16 - cmpri);
 
   /* Start at element 0 of the route */
-  hop_ptr = (uint8_t *)route.nodes;
+  hop_ptr = (uint8_t *)route->nodes;
   /* Do route from src to root */
   node = src_node;
   while(node != NULL) {
@@ -215,14 +216,14 @@ run(void *data)
   }
 
   /* Set the route */
-  route.cmpr = cmpri;
-  route.length = path_len + 1;
+  route->cmpr = cmpri;
+  route->length = path_len + 1;
 
   LOG_INFO("Found RPL NS route\n");
-  // PRINTFNC(TRACE_LEVEL, print_sdn_srh_route(&route));
+  // PRINTFNC(TRACE_LEVEL, print_sdn_srh_route(route));
 
   /* Return the response */
-  return atom_response_buf_copy_to(ATOM_RESPONSE_ROUTING, &route);
+  return atom_response_buf_copy_to(ATOM_RESPONSE_ROUTING, &response);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -232,5 +233,6 @@ struct atom_app app_route_rpl = {
   "RPL Routing",
   ATOM_ACTION_ROUTING,
   init,
-  run
+  run,
+  NULL
 };
@@ -31,10 +31,13 @@
  */
 /**
  * \file
- *         Atom SDN Controller: Shortest path routing application.
+ *         Atom SDN Controller: Shortest path routing application. Routes on
+ *                              hop count (BFS) or RSSI link cost (Dijkstra).
  * \author
  *         Michael Baddeley <m.baddeley@bristol.ac.uk>
  */
+#include <string.h>
+
 #include "net/ip/uip.h"
 
 #include "net/sdn/sdn.h"
@@ -46,36 +49,53 @@
 #define LOG_MODULE "ATOM"
 #define LOG_LEVEL LOG_LEVEL_ATOM
 
-/* Search */
-static atom_node_t *stack[ATOM_MAX_NODES];  /* Stack for searching */
-static int top = -1;                  /* Keeps track of the stack index */
+/* Shortest path tree rooted at a source. Indexed by node slot (see
+   atom_net_node_slot()). */
+typedef struct sp_tree {
+  atom_node_t *src;                   /* NULL if the tree is invalid */
+  uint16_t     last_used;             /* For LRU replacement */
+  atom_node_t *prev[ATOM_MAX_NODES];  /* Previous hop on the best path */
+  uint16_t     dist[ATOM_MAX_NODES];  /* Cost of the best path so far */
+} sp_tree_t;
 
-/* Path */
-static atom_node_t *spath[ATOM_MAX_NODES];  /* Keeps track of shortest path */
-static int spath_length = ATOM_MAX_NODES;  /* Assume worst case */
+/* Route cache. With the cache disabled we still need one tree to search
+   into. */
+#if ATOM_ROUTE_SP_CACHE_SIZE
+#define SP_NUM_TREES ATOM_ROUTE_SP_CACHE_SIZE
+#else
+#define SP_NUM_TREES 1
+#endif
+static sp_tree_t trees[SP_NUM_TREES];
+#if ATOM_ROUTE_SP_CACHE_SIZE
+static uint16_t use_count;
+#endif
+
+/* BFS queue / Dijkstra binary heap */
+static atom_node_t *heap[ATOM_MAX_NODES];
+static uint16_t heap_len;
+#if ATOM_ROUTE_SP_METRIC == ATOM_ROUTE_SP_METRIC_RSSI
+static uint16_t heap_pos[ATOM_MAX_NODES];   /* Position of each slot in heap */
+#else
+static uint16_t queue_head;
+#endif
+
+#if ATOM_ROUTE_SP_HBH_QUERIES
+/* Queries seen per flow, to tell long lived flows from short ones */
+typedef struct sp_flow {
+  sdn_node_id_t src;
+  sdn_node_id_t dest;
+  uint8_t       queries;              /* 0 if the slot is free */
+  unsigned long last;                 /* clock_seconds() of the last query */
+} sp_flow_t;
+static sp_flow_t flows[ATOM_ROUTE_SP_FLOWS];
+#endif /* ATOM_ROUTE_SP_HBH_QUERIES */
+
+#define SP_INFINITE 0xFFFF
+#define DIST(t, n)  ((t)->dist[atom_net_node_slot(n)])
+#define PREV(t, n)  ((t)->prev[atom_net_node_slot(n)])
 
 /*---------------------------------------------------------------------------*/
 /* Printing */
-/*---------------------------------------------------------------------------*/
-// static void
-// print_stack() {
-//   int i;
-//   PRINTF("ATOM-APP : STACK ================\n\n");
-//   PRINTF("ATOM-APP : \n\n");
-//   for(i = 0; i <= top; i++) {
-//     PRINTF(" %d ", stack[i]->id);
-//   }
-//   PRINTF("\nATOM-APP : ======================\n\n");
-// }
-/*---------------------------------------------------------------------------*/
-// static void
-// print_shortest_path() {
-//   int i;
-//   for(i = 0; i < spath_length; i++) {
-//     PRINTF(" %d ", spath[i]->id);
-//   }
-// }
-
 /*---------------------------------------------------------------------------*/
 #if LOG_LEVEL >= LOG_LEVEL_DBG
 static void
@@ -90,106 +110,367 @@ static void print_route(sdn_srh_route_t *route) {}
 #endif /* LOG_LEVEL >= LOG_LEVEL_DBG */
 
 /*---------------------------------------------------------------------------*/
-/* Stack and Shortest Path */
+/* Link Cost */
+/*---------------------------------------------------------------------------*/
+#if ATOM_ROUTE_SP_METRIC == ATOM_ROUTE_SP_METRIC_RSSI || ATOM_ROUTE_SP_CACHE_SIZE
+static uint16_t
+link_cost(int16_t rssi)
+{
+#if ATOM_ROUTE_SP_METRIC == ATOM_ROUTE_SP_METRIC_RSSI
+  /* One per hop, plus one per ATOM_ROUTE_SP_RSSI_STEP dBm below
+     ATOM_ROUTE_SP_RSSI_GOOD. Links we haven't got an RSSI for yet (0) are
+     treated as good. */
+  if(rssi == 0 || rssi >= ATOM_ROUTE_SP_RSSI_GOOD) {
+    return 1;
+  }
+  return 1 + (ATOM_ROUTE_SP_RSSI_GOOD - rssi) / ATOM_ROUTE_SP_RSSI_STEP;
+#else
+  return 1;
+#endif
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/* Search */
 /*---------------------------------------------------------------------------*/
 static void
-push(atom_node_t *n) {
-   stack[++top] = n;
+search_init(sp_tree_t *t, atom_node_t *src)
+{
+  int i;
+  for(i = 0; i < ATOM_MAX_NODES; i++) {
+    t->prev[i] = NULL;
+    t->dist[i] = SP_INFINITE;
+  }
+  t->src = src;
+  DIST(t, src) = 0;
+  heap_len = 0;
 }
 
+#if ATOM_ROUTE_SP_METRIC == ATOM_ROUTE_SP_METRIC_RSSI
+/*---------------------------------------------------------------------------*/
+static void
+heap_swap(uint16_t a, uint16_t b)
+{
+  atom_node_t *tmp = heap[a];
+  heap[a] = heap[b];
+  heap[b] = tmp;
+  heap_pos[atom_net_node_slot(heap[a])] = a;
+  heap_pos[atom_net_node_slot(heap[b])] = b;
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+heap_up(sp_tree_t *t, uint16_t i)
+{
+  while(i > 0 && DIST(t, heap[(i - 1) / 2]) > DIST(t, heap[i])) {
+    heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+heap_down(sp_tree_t *t, uint16_t i)
+{
+  uint16_t l, r, min;
+  while(1) {
+    l = 2 * i + 1;
+    r = l + 1;
+    min = i;
+    if(l < heap_len && DIST(t, heap[l]) < DIST(t, heap[min])) {
+      min = l;
+    }
+    if(r < heap_len && DIST(t, heap[r]) < DIST(t, heap[min])) {
+      min = r;
+    }
+    if(min == i) {
+      return;
+    }
+    heap_swap(i, min);
+    i = min;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
 static atom_node_t *
-pop() {
-   return stack[top--];
+heap_pop(sp_tree_t *t)
+{
+  atom_node_t *n = heap[0];
+  heap_len--;
+  if(heap_len > 0) {
+    heap[0] = heap[heap_len];
+    heap_pos[atom_net_node_slot(heap[0])] = 0;
+    heap_down(t, 0);
+  }
+  return n;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Insert n, or move it up the heap if it's already there with a higher
+   cost */
+static void
+heap_push_or_decrease(sp_tree_t *t, atom_node_t *n)
+{
+  uint16_t slot = atom_net_node_slot(n);
+  if(heap_pos[slot] < heap_len && heap[heap_pos[slot]] == n) {
+    heap_up(t, heap_pos[slot]);
+  } else {
+    heap[heap_len] = n;
+    heap_pos[slot] = heap_len;
+    heap_up(t, heap_len++);
+  }
 }
 
-// static atom_node_t *
-// peek() {
-//    return stack[top];
-// }
+/*---------------------------------------------------------------------------*/
+/* Dijkstra over link costs. Stops early once dest is settled, or builds the
+   whole tree if dest is NULL. */
+static void
+shortest_path_search(sp_tree_t *t, atom_node_t *src, atom_node_t *dest)
+{
+  int i;
+  uint16_t cost;
+  atom_node_t *n, *nbr;
+  atom_link_t *l;
 
-// static int
-// is_empty() {
-//    return top == -1;
-// }
+  search_init(t, src);
+  heap_push_or_decrease(t, src);
 
-static int
-size() {
-  return top+1;
+  while(heap_len > 0) {
+    n = heap_pop(t);
+    if(n == dest) {
+      return;
+    }
+    l = atom_net_node_links(n);
+    for(i = 0; i < n->num_links; i++) {
+      nbr = atom_net_link_dest(&l[i]);
+      /* Costs are never zero, so settled nodes can't be improved upon */
+      cost = DIST(t, n) + link_cost(l[i].rssi);
+      if(cost < DIST(t, nbr)) {
+        DIST(t, nbr) = cost;
+        PREV(t, nbr) = n;
+        heap_push_or_decrease(t, nbr);
+      }
+    }
+  }
 }
 
-static int
-contains(int id) {
+#else /* ATOM_ROUTE_SP_METRIC == ATOM_ROUTE_SP_METRIC_RSSI */
+/*---------------------------------------------------------------------------*/
+/* Breadth first search on hop count. Stops early once dest is found, or
+   builds the whole tree if dest is NULL. */
+static void
+shortest_path_search(sp_tree_t *t, atom_node_t *src, atom_node_t *dest)
+{
   int i;
-  for (i = 0; i <= top; i++) {
-    if(stack[i]->id == id) {
+  atom_node_t *n, *nbr;
+  atom_link_t *l;
+
+  search_init(t, src);
+  /* The heap array is used as a plain FIFO queue */
+  queue_head = 0;
+  heap[heap_len++] = src;
+
+  while(queue_head < heap_len) {
+    n = heap[queue_head++];
+    l = atom_net_node_links(n);
+    for(i = 0; i < n->num_links; i++) {
+      nbr = atom_net_link_dest(&l[i]);
+      if(DIST(t, nbr) != SP_INFINITE) {
+        continue;
+      }
+      DIST(t, nbr) = DIST(t, n) + 1;
+      PREV(t, nbr) = n;
+      if(nbr == dest) {
+        return;
+      }
+      heap[heap_len++] = nbr;
+    }
+  }
+}
+#endif /* ATOM_ROUTE_SP_METRIC == ATOM_ROUTE_SP_METRIC_RSSI */
+
+/*---------------------------------------------------------------------------*/
+/* Route Cache */
+/*---------------------------------------------------------------------------*/
+/* Returns a tree rooted at src which reaches dest if there is a path */
+static sp_tree_t *
+get_tree(atom_node_t *src, atom_node_t *dest)
+{
+#if ATOM_ROUTE_SP_CACHE_SIZE
+  int i;
+  sp_tree_t *t = &trees[0];
+
+  use_count++;
+  for(i = 0; i < SP_NUM_TREES; i++) {
+    if(trees[i].src == src) {
+      LOG_DBG("Route cache hit for [%d]\n", src->id);
+      trees[i].last_used = use_count;
+      return &trees[i];
+    }
+    /* Otherwise replace an invalid tree, or the least recently used */
+    if(t->src != NULL && (trees[i].src == NULL ||
+       (uint16_t)(use_count - trees[i].last_used) >
+       (uint16_t)(use_count - t->last_used))) {
+      t = &trees[i];
+    }
+  }
+  /* Build the whole tree so it can answer for any destination */
+  shortest_path_search(t, src, NULL);
+  t->last_used = use_count;
+  return t;
+#else
+  shortest_path_search(&trees[0], src, dest);
+  return &trees[0];
+#endif /* ATOM_ROUTE_SP_CACHE_SIZE */
+}
+
+/*---------------------------------------------------------------------------*/
+/* Walk back from dest to src and write the route out src first. Returns 0
+   if the path doesn't fit in a route. */
+static int
+copy_to_route(sp_tree_t *t, atom_node_t *dest, sdn_srh_route_t *route)
+{
+  int len = 1;
+  atom_node_t *n;
+
+  for(n = dest; n != t->src; n = PREV(t, n)) {
+    len++;
+  }
+  if(len > SDN_CONF_MAX_ROUTE_LEN) {
+    LOG_ERR("ERROR Path of %d hops is longer than %d!\n",
+            len, SDN_CONF_MAX_ROUTE_LEN);
+    return 0;
+  }
+  route->cmpr = 15;
+  route->length = len;
+  for(n = dest; len > 0; n = PREV(t, n)) {
+    route->nodes[--len] = n->id;
+  }
+  return 1;
+}
+
+#if ATOM_ROUTE_SP_HBH_QUERIES && ATOM_ROUTE_SP_AGGREGATE
+/*---------------------------------------------------------------------------*/
+/* Subtree Aggregation */
+/*---------------------------------------------------------------------------*/
+/* Whether the tree's path to n goes through relay */
+static uint8_t
+is_behind(sp_tree_t *t, atom_node_t *n, atom_node_t *relay)
+{
+  if(DIST(t, n) == SP_INFINITE) {
+    return 0;
+  }
+  for(n = PREV(t, n); n != NULL; n = PREV(t, n)) {
+    if(n == relay) {
       return 1;
     }
   }
   return 0;
 }
 
-void
-clear_spath(void) {
-  int i;
-  for(i = 0; i < ATOM_MAX_NODES; i++) {
-    spath[i] = NULL;
+/*---------------------------------------------------------------------------*/
+/* Whether no node outside relay's subtree has dest's interface id, once the
+   wildcard bits are ignored */
+static uint8_t
+wildcard_ok(sp_tree_t *t, atom_node_t *relay, atom_node_t *dest,
+            uint8_t *wildcard)
+{
+  uint8_t i;
+  atom_node_t *n;
+  uint8_t *iid = &dest->ipaddr.u8[sizeof(uip_ipaddr_t) - ATOM_IID_LEN];
+
+  for(n = atom_net_get_nodes(); n != NULL; n = n->next) {
+    if(n == dest || uip_is_addr_unspecified(&n->ipaddr) ||
+       is_behind(t, n, relay)) {
+      continue;
+    }
+    for(i = 0; i < ATOM_IID_LEN; i++) {
+      if((n->ipaddr.u8[sizeof(uip_ipaddr_t) - ATOM_IID_LEN + i] ^ iid[i]) &
+         ~wildcard[i]) {
+        break;
+      }
+    }
+    if(i == ATOM_IID_LEN) {
+      return 0;
+    }
   }
-  spath_length = ATOM_MAX_NODES;
+  return 1;
 }
 
+/*---------------------------------------------------------------------------*/
+/* Widen the wildcard for each node behind dest's relay in turn, as long as
+   it still leaves out every node that isn't */
 static void
-copy_to_spath() {
-  int i;
-  for(i = 0; i<= top; i++) {
-    spath[i] = stack[i];
+subtree_wildcard(sp_tree_t *t, atom_node_t *dest, uint8_t *wildcard)
+{
+  uint8_t i, w[ATOM_IID_LEN];
+  atom_node_t *n, *relay = PREV(t, dest);
+  uint8_t *iid = &dest->ipaddr.u8[sizeof(uip_ipaddr_t) - ATOM_IID_LEN];
+
+  memset(wildcard, 0, ATOM_IID_LEN);
+  for(n = atom_net_get_nodes(); n != NULL; n = n->next) {
+    if(n == dest || uip_is_addr_unspecified(&n->ipaddr) ||
+       !is_behind(t, n, relay)) {
+      continue;
+    }
+    for(i = 0; i < ATOM_IID_LEN; i++) {
+      w[i] = wildcard[i] |
+             (n->ipaddr.u8[sizeof(uip_ipaddr_t) - ATOM_IID_LEN + i] ^ iid[i]);
+    }
+    if(wildcard_ok(t, relay, dest, w)) {
+      memcpy(wildcard, w, ATOM_IID_LEN);
+    }
   }
-  spath_length = top+1;
 }
+#endif /* ATOM_ROUTE_SP_HBH_QUERIES && ATOM_ROUTE_SP_AGGREGATE */
 
+#if ATOM_ROUTE_SP_HBH_QUERIES
 /*---------------------------------------------------------------------------*/
-static void
-depth_first_search(atom_node_t *src, atom_node_t *dest)
+/* Count a query from src to dest, returning whether the flow is long lived */
+static uint8_t
+flow_is_long(atom_node_t *src, atom_node_t *dest)
 {
   int i;
-  atom_node_t *new_src;
-  if(src != NULL && dest != NULL) {
-    /* push to the search stack */
-    push(src);
-    /* Check if we have reached the destination */
-    if(src->id == dest->id) {
-      /* If this stack is the shortest we want to copy the path */
-      if(size() <= spath_length) {
-        clear_spath();
-        copy_to_spath();
+  unsigned long now = clock_seconds();
+  sp_flow_t *f, *victim = &flows[0];
+
+  for(i = 0; i < ATOM_ROUTE_SP_FLOWS; i++) {
+    f = &flows[i];
+    if(f->queries > 0 && f->src == src->id && f->dest == dest->id) {
+      /* Start counting again if it's gone quiet for a while */
+      if(now - f->last > ATOM_ROUTE_SP_FLOW_WINDOW) {
+        f->queries = 0;
       }
-      /* Pop the stack */
-      pop(src);
-      return;
+      break;
     }
-    /* If we havent reached the destination, then search the neighbours that
-       haven't been visited */
-    for(i = 0; i < src->num_links; i++) {
-      if(!contains(src->links[i].dest_id)) {
-        new_src = atom_net_get_node_id(src->links[i].dest_id);
-        if(new_src != NULL) {
-          depth_first_search(new_src, dest);
-        } else {
-          LOG_ERR("ERROR DFS could not find node!\n");
-        }
-      }
+    /* Replace a free slot, or the flow we heard from longest ago */
+    if(victim->queries > 0 && (f->queries == 0 || f->last < victim->last)) {
+      victim = f;
     }
-    /* Pop the stack */
-    pop(src);
-  } else {
-    LOG_ERR("ERROR depth_first_search SRC or DEST was NULL!\n");
   }
+  if(i == ATOM_ROUTE_SP_FLOWS) {
+    f = victim;
+    f->src = src->id;
+    f->dest = dest->id;
+    f->queries = 0;
+  }
+  if(f->queries < 0xFF) {
+    f->queries++;
+  }
+  f->last = now;
+  return f->queries >= ATOM_ROUTE_SP_HBH_QUERIES;
 }
+#endif /* ATOM_ROUTE_SP_HBH_QUERIES */
 
 /*---------------------------------------------------------------------------*/
 /* Application API */
 /*---------------------------------------------------------------------------*/
 static void
 init(void) {
+  memset(trees, 0, sizeof(trees));
+#if ATOM_ROUTE_SP_HBH_QUERIES
+  memset(flows, 0, sizeof(flows));
+#endif /* ATOM_ROUTE_SP_HBH_QUERIES */
   LOG_INFO("Atom shortest path routing app initialised\n");
 }
 
@@ -197,48 +478,96 @@ init(void) {
 static atom_response_t *
 run(void *data)
 {
-  int i;
-  sdn_srh_route_t route;
+  atom_routing_response_t response = {0};
+  sdn_srh_route_t *route = &response.route;
   atom_node_t *src, *dest;
+  sp_tree_t *t;
 
   /* Dereference the action data */
   atom_routing_action_t *action = (atom_routing_action_t *)data;
 
   /* Get the nodes from the net layer */
-  if(&action->src != NULL && &action->dest != NULL) {
-    src = atom_net_get_node_ipaddr(&action->src);
-    dest = atom_net_get_node_ipaddr(&action->dest);
-  } else {
-    LOG_ERR( "src or dest is NULL\n");
+  src = atom_net_get_node_ipaddr(&action->src);
+  dest = atom_net_get_node_ipaddr(&action->dest);
+  if(src == NULL) {
+    LOG_ERR("src is NULL\n");
     return NULL;
   }
+  if(dest == NULL) {
+    /* Tell src, so it stops asking for a while */
+    LOG_ERR("dest is NULL\n");
+    return atom_response_buf_copy_to(ATOM_RESPONSE_ROUTING, &response);
+  }
 
-  /* Make sure the spath is cleared */
-  clear_spath();
-  /* Perform the DFS */
-  depth_first_search(src, dest);
-  /* Check DFS was succesful */
-  if(spath[0] != NULL) {
+  /* Perform the search (or look up the cached tree) */
+  t = get_tree(src, dest);
+  if(DIST(t, dest) != SP_INFINITE) {
     /* Copy to route */
-    route.cmpr = 15;
-    route.length = spath_length;
-    for(i = 0; i < spath_length; i++) {
-      route.nodes[i] = spath[i]->id;
+    if(!copy_to_route(t, dest, route)) {
+      return NULL;
     }
     LOG_DBG("Found route from ");
     LOG_DBG_6ADDR(&action->src);
     LOG_DBG_(" to ");
     LOG_DBG_6ADDR(&action->dest);
-    print_route(&route);
+    print_route(route);
     LOG_DBG_("\n");
+#if ATOM_ROUTE_SP_HBH_QUERIES
+    response.hop_by_hop = route->length > 1 && flow_is_long(src, dest);
+#if ATOM_ROUTE_SP_AGGREGATE
+    /* Only worth it if there are nodes ahead of the last relay */
+    if(response.hop_by_hop && route->length > 2) {
+#if !ATOM_ROUTE_SP_CACHE_SIZE
+      /* The search stopped at dest, but we need the whole tree */
+      shortest_path_search(t, src, NULL);
+#endif /* !ATOM_ROUTE_SP_CACHE_SIZE */
+      subtree_wildcard(t, dest, response.wildcard);
+    }
+#endif /* ATOM_ROUTE_SP_AGGREGATE */
+#endif /* ATOM_ROUTE_SP_HBH_QUERIES */
   } else {
-    LOG_ERR("ERROR No path between [%d] and [%d]! MAX_NODES=%d",
+    LOG_ERR("ERROR No path between [%d] and [%d]! MAX_NODES=%d\n",
       src->id, dest->id, ATOM_MAX_NODES);
-    return NULL;
+    /* An empty route tells src there's no route */
   }
 
   /* Return the response */
-  return atom_response_buf_copy_to(ATOM_RESPONSE_ROUTING, &route);
+  return atom_response_buf_copy_to(ATOM_RESPONSE_ROUTING, &response);
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+link_update(atom_node_t *src, atom_link_t *l, int16_t old_rssi, uint8_t change)
+{
+#if ATOM_ROUTE_SP_CACHE_SIZE
+  int i;
+  sp_tree_t *t;
+  atom_node_t *dest;
+  uint16_t old_cost, new_cost;
+
+  dest = atom_net_link_dest(l);
+  old_cost = link_cost(old_rssi);
+  new_cost = link_cost(l->rssi);
+  if(change == ATOM_LINK_CHANGED && old_cost == new_cost) {
+    /* Nothing any tree could have seen has changed */
+    return;
+  }
+  for(i = 0; i < SP_NUM_TREES; i++) {
+    t = &trees[i];
+    if(t->src == NULL || DIST(t, src) == SP_INFINITE) {
+      /* The link isn't reachable from this tree's source */
+      continue;
+    }
+    /* Drop the tree if the link is on it and its cost has changed or it's
+       gone, or if it now gives a shorter path to dest */
+    if((change != ATOM_LINK_ADDED && PREV(t, dest) == src) ||
+       (change != ATOM_LINK_REMOVED &&
+        DIST(t, src) + new_cost < DIST(t, dest))) {
+      LOG_DBG("Route cache invalidated for [%d]\n", t->src->id);
+      t->src = NULL;
+    }
+  }
+#endif /* ATOM_ROUTE_SP_CACHE_SIZE */
 }
 
 /*---------------------------------------------------------------------------*/
@@ -248,5 +577,6 @@ struct atom_app app_route_sp = {
   "SP Routing",
   ATOM_ACTION_ROUTING,
   init,
-  run
+  run,
+  link_update
 };
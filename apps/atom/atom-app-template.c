@@ -78,5 +78,6 @@ struct atom_app app_route_sp = {
   ...,             /* TODO */
   ATOM_ACTION_XXX, /* TODO */
   init,
-  run
+  run,
+  NULL
 };
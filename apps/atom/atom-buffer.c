@@ -185,7 +185,8 @@ atom_action_buf_copy_to(atom_action_type_t type, void *data)
   /* Get length from type */
   switch(type) {
     case ATOM_ACTION_NETUPDATE:
-      action_buf.datalen = sizeof(atom_netupdate_action_t);
+      action_buf.datalen = sizeof(atom_netupdate_action_t) +
+                           ((atom_netupdate_action_t *)data)->len;
       break;
     case ATOM_ACTION_ROUTING:
       action_buf.datalen = sizeof(atom_routing_action_t);
@@ -48,6 +48,29 @@
 #define ATOM_BUFFER_MAX         3
 #endif
 
+/* Number of FTS and CFG messages to keep and send again until the node acks
+   them (CACK). A hop by hop route takes one per node on the path. 0 to send
+   them once */
+#ifdef ATOM_CONF_TX_LEN
+#define ATOM_TX_LEN             ATOM_CONF_TX_LEN
+#else
+#define ATOM_TX_LEN             8
+#endif
+
+/* How long to wait for the first ack. Doubles after each resend */
+#ifdef ATOM_CONF_TX_TIMEOUT
+#define ATOM_TX_TIMEOUT         ATOM_CONF_TX_TIMEOUT
+#else
+#define ATOM_TX_TIMEOUT         (CLOCK_SECOND * 2)
+#endif
+
+/* Most times to send an unacked message */
+#ifdef ATOM_CONF_TX_TRIES
+#define ATOM_TX_TRIES           ATOM_CONF_TX_TRIES
+#else
+#define ATOM_TX_TRIES           4
+#endif
+
 /* All atom apps */
 #define ATOM_APPS { &app_route_sp, &app_route_rpl } // , &app_agg
 /* All atom sb connectors */
@@ -63,6 +86,95 @@
 #define ATOM_MAX_NODES           42
 #endif
 
+/* Max number of links over all nodes */
+#ifdef ATOM_CONF_MAX_LINKS
+#define ATOM_MAX_LINKS           ATOM_CONF_MAX_LINKS
+#else
+#define ATOM_MAX_LINKS           (ATOM_MAX_NODES * NBR_TABLE_CONF_MAX_NEIGHBORS)
+#endif
+
+/* Buckets in the node id index. Power of 2, at least ATOM_MAX_NODES. */
+#ifdef ATOM_NET_CONF_HASH_SIZE
+#define ATOM_NET_HASH_SIZE       ATOM_NET_CONF_HASH_SIZE
+#elif ATOM_MAX_NODES <= 64
+#define ATOM_NET_HASH_SIZE       64
+#elif ATOM_MAX_NODES <= 128
+#define ATOM_NET_HASH_SIZE       128
+#elif ATOM_MAX_NODES <= 256
+#define ATOM_NET_HASH_SIZE       256
+#elif ATOM_MAX_NODES <= 512
+#define ATOM_NET_HASH_SIZE       512
+#else
+#define ATOM_NET_HASH_SIZE       1024
+#endif
+
+/*---------------------------------------------------------------------------*/
+/* Atom shortest path routing configuration */
+/*---------------------------------------------------------------------------*/
+/* Route on hop count (BFS) or on link RSSI (Dijkstra) */
+#define ATOM_ROUTE_SP_METRIC_HOPS    0
+#define ATOM_ROUTE_SP_METRIC_RSSI    1
+#ifdef ATOM_CONF_ROUTE_SP_METRIC
+#define ATOM_ROUTE_SP_METRIC     ATOM_CONF_ROUTE_SP_METRIC
+#else
+#define ATOM_ROUTE_SP_METRIC     ATOM_ROUTE_SP_METRIC_HOPS
+#endif
+
+/* RSSI (dBm) at or above which a link costs a single hop */
+#ifdef ATOM_CONF_ROUTE_SP_RSSI_GOOD
+#define ATOM_ROUTE_SP_RSSI_GOOD  ATOM_CONF_ROUTE_SP_RSSI_GOOD
+#else
+#define ATOM_ROUTE_SP_RSSI_GOOD  -70
+#endif
+
+/* Every ATOM_ROUTE_SP_RSSI_STEP dBm below 'good' adds one to the link cost */
+#ifdef ATOM_CONF_ROUTE_SP_RSSI_STEP
+#define ATOM_ROUTE_SP_RSSI_STEP  ATOM_CONF_ROUTE_SP_RSSI_STEP
+#else
+#define ATOM_ROUTE_SP_RSSI_STEP  5
+#endif
+
+/* Number of per-source shortest path trees to cache. Repeat queries from a
+   cached source are answered without a search. 0 to disable. */
+#ifdef ATOM_CONF_ROUTE_SP_CACHE_SIZE
+#define ATOM_ROUTE_SP_CACHE_SIZE ATOM_CONF_ROUTE_SP_CACHE_SIZE
+#else
+#define ATOM_ROUTE_SP_CACHE_SIZE 4
+#endif
+
+/* Atom only sees a flow when its source queries, so a flow that keeps
+   querying (each time within ATOM_ROUTE_SP_FLOW_WINDOW seconds of the last)
+   is taken to be long lived. Once a flow has queried ATOM_ROUTE_SP_HBH_QUERIES
+   times its route is installed hop-by-hop, with FORWARD entries on every node
+   on the path, so its packets no longer carry an SRH. 0 to always use SRH. */
+#ifdef ATOM_CONF_ROUTE_SP_HBH_QUERIES
+#define ATOM_ROUTE_SP_HBH_QUERIES ATOM_CONF_ROUTE_SP_HBH_QUERIES
+#else
+#define ATOM_ROUTE_SP_HBH_QUERIES 0
+#endif
+
+#ifdef ATOM_CONF_ROUTE_SP_FLOW_WINDOW
+#define ATOM_ROUTE_SP_FLOW_WINDOW ATOM_CONF_ROUTE_SP_FLOW_WINDOW
+#else
+#define ATOM_ROUTE_SP_FLOW_WINDOW 600
+#endif
+
+/* Number of flows to count queries for */
+#ifdef ATOM_CONF_ROUTE_SP_FLOWS
+#define ATOM_ROUTE_SP_FLOWS      ATOM_CONF_ROUTE_SP_FLOWS
+#else
+#define ATOM_ROUTE_SP_FLOWS      8
+#endif
+
+/* When a route is installed hop-by-hop, have the nodes ahead of the last
+   relay match on a masked destination covering the other nodes behind that
+   relay too, so they need one entry for all of them */
+#ifdef ATOM_CONF_ROUTE_SP_AGGREGATE
+#define ATOM_ROUTE_SP_AGGREGATE  ATOM_CONF_ROUTE_SP_AGGREGATE
+#else
+#define ATOM_ROUTE_SP_AGGREGATE  1
+#endif
+
 /*---------------------------------------------------------------------------*/
 /* usdn southbound connection configuration */
 /*---------------------------------------------------------------------------*/
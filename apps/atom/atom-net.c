@@ -61,12 +61,32 @@
 /*---------------------------------------------------------------------------*/
 LIST(nodes);
 MEMB(nodes_memb, atom_node_t, ATOM_MAX_NODES);
+
+/* Node id index. Open addressed (linear probing) table of node slot + 1,
+   0 if empty. Nodes are never freed, so there are no tombstones. */
+#if (ATOM_NET_HASH_SIZE & (ATOM_NET_HASH_SIZE - 1)) || \
+    (ATOM_NET_HASH_SIZE < ATOM_MAX_NODES)
+#error "ATOM_NET_HASH_SIZE must be a power of 2 of at least ATOM_MAX_NODES"
+#endif
+static uint16_t id_index[ATOM_NET_HASH_SIZE];
+#define ID_HASH(id) ((id) & (ATOM_NET_HASH_SIZE - 1))
+
+/* Links in CSR form. The links of the node in slot s are
+   links[link_start[s]] to links[link_start[s + 1] - 1]. */
+static atom_link_t links[ATOM_MAX_LINKS];
+static uint16_t link_start[ATOM_MAX_NODES + 1];
+
+#define SLOT(n)         atom_net_node_slot(n)
+#define NODE_AT(slot)   ((atom_node_t *)nodes_memb.mem + (slot))
+
 /*---------------------------------------------------------------------------*/
 void
 atom_net_init(void)
 {
   list_init(nodes);
   memb_init(&nodes_memb);
+  memset(id_index, 0, sizeof(id_index));
+  memset(link_start, 0, sizeof(link_start));
 
   LOG_INFO("Atom net initialised\n");
 }
@@ -100,6 +120,35 @@ node_allocate(void)
 // LOG_ANNOTATE("#A n=%d/%d\n", list_length(nodes), ATOM_MAX_NODES);
 // }
 
+/*---------------------------------------------------------------------------*/
+/* Node Index */
+/*---------------------------------------------------------------------------*/
+static void
+index_add(atom_node_t *n)
+{
+  uint16_t i = ID_HASH(n->id);
+  /* There's always a free bucket, as there are at least as many buckets as
+     nodes */
+  while(id_index[i] != 0) {
+    i = ID_HASH(i + 1);
+  }
+  id_index[i] = SLOT(n) + 1;
+}
+
+/*---------------------------------------------------------------------------*/
+static atom_node_t *
+index_lookup(sdn_node_id_t id)
+{
+  uint16_t i = ID_HASH(id);
+  while(id_index[i] != 0) {
+    if(NODE_AT(id_index[i] - 1)->id == id) {
+      return NODE_AT(id_index[i] - 1);
+    }
+    i = ID_HASH(i + 1);
+  }
+  return NULL;
+}
+
 /*---------------------------------------------------------------------------*/
 /* Static functions */
 /*---------------------------------------------------------------------------*/
@@ -116,6 +165,7 @@ node_add(uip_ipaddr_t *ipaddr)
     n->cfg_id = 0;
     /* Add to node list */
     list_add(nodes, n);
+    index_add(n);
     LOG_DBG("Added node [%d] from IP [", n->id);
     LOG_DBG_6ADDR(&n->ipaddr);
     LOG_DBG_("]\n");
@@ -138,6 +188,7 @@ node_add_id(sdn_node_id_t id)
     n->id = id;
     /* Add to node list */
     list_add(nodes, n);
+    index_add(n);
     LOG_DBG("Added node id [%d]\n", n->id);
     return n;
   }
@@ -145,38 +196,55 @@ node_add_id(sdn_node_id_t id)
   return n;
 }
 
+/*---------------------------------------------------------------------------*/
 static atom_link_t *
 link_exists(atom_node_t *src, atom_node_t *dest)
 {
-  int i = 0;
+  int i;
+  atom_link_t *l;
   if(src != NULL && dest != NULL) {
     LOG_DBG("Check link (%d->%d)\n", src->id, dest->id);
-    if(src->num_links <= ATOM_MAX_LINKS_PER_NODE) {
-      for(i = 0; i < src->num_links; i++) {
-        if(src->links[i].dest_id == dest->id) {
-          return &src->links[i];
-        }
+    l = atom_net_node_links(src);
+    for(i = 0; i < src->num_links; i++) {
+      if(l[i].dest_slot == SLOT(dest)) {
+        return &l[i];
       }
-      LOG_DBG("Link (%d->%d) does not exist!\n", src->id, dest->id);
-    } else {
-      LOG_ERR("We have more links than we should!\n");
     }
+    LOG_DBG("Link (%d->%d) does not exist!\n", src->id, dest->id);
   }
   /* Link does not exist */
   return NULL;
 }
 
 /*---------------------------------------------------------------------------*/
+/* Inserts at the end of src's links, shifting the links of all following
+   slots up by one. New links are rare once the network has formed, so we
+   pay for the compact layout here rather than on every lookup. */
 static atom_link_t *
 link_add(atom_node_t *src, atom_node_t *dest)
 {
-  int eol; /*End of List*/
+  uint16_t pos, s;
+  atom_link_t *l;
   if((src != NULL) && (dest != NULL)) {
-    eol = src->num_links;
-    /* Set link destination id */
-    src->links[eol].dest_id = dest->id;
+    if(link_start[ATOM_MAX_NODES] >= ATOM_MAX_LINKS) {
+      LOG_ERR("FAILED to add a link (%d->%d), link table is full!\n",
+              src->id, dest->id);
+      return NULL;
+    }
+    pos = link_start[SLOT(src) + 1];
+    memmove(&links[pos + 1], &links[pos],
+            (link_start[ATOM_MAX_NODES] - pos) * sizeof(atom_link_t));
+    for(s = SLOT(src) + 1; s <= ATOM_MAX_NODES; s++) {
+      link_start[s]++;
+    }
+    l = &links[pos];
+    memset(l, 0, sizeof(atom_link_t));
+    /* Set link destination */
+    l->dest_id = dest->id;
+    l->dest_slot = SLOT(dest);
     src->num_links++;
-    return &src->links[eol];
+    LOG_ANNOTATE("#A l=%d/%d\n", link_start[ATOM_MAX_NODES], ATOM_MAX_LINKS);
+    return l;
   }
   LOG_ERR("FAILED to add a link!\n");
   return NULL;
@@ -191,10 +259,11 @@ atom_net_get_node_ipaddr(uip_ipaddr_t *ipaddr)
   atom_node_t *n;
 
   if(ipaddr != NULL) {
-    for(n = list_head(nodes); n != NULL; n = list_item_next(n)) {
-      if(&n->ipaddr != NULL && uip_ipaddr_cmp(&n->ipaddr, ipaddr)) {
-        return n;
-      }
+    /* Node ids are taken from the ipaddr, so look up by id and check the
+       address matches */
+    n = index_lookup(sdn_node_id_from_ipaddr(ipaddr));
+    if(n != NULL && uip_ipaddr_cmp(&n->ipaddr, ipaddr)) {
+      return n;
     }
     LOG_WARN("Node [%d] does not exist for ipaddr [", ipaddr->u8[15]);
     LOG_WARN_6ADDR(ipaddr);
@@ -213,15 +282,46 @@ atom_net_get_node_id(sdn_node_id_t id)
 {
   atom_node_t *n;
 
-  for(n = list_head(nodes); n != NULL; n = list_item_next(n)) {
-    if (n->id == id) {
-      return n;
-    }
+  if((n = index_lookup(id)) != NULL) {
+    return n;
   }
   LOG_DBG("Node id [%d] does not exist\n", id);
   return NULL;
 }
 
+/*---------------------------------------------------------------------------*/
+/* First of the known nodes, follow ->next for the rest */
+atom_node_t *
+atom_net_get_nodes(void)
+{
+  return list_head(nodes);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Index of the node within the node memory (0 to ATOM_MAX_NODES - 1), for
+   apps that keep per-node state in arrays */
+uint16_t
+atom_net_node_slot(atom_node_t *n)
+{
+  return (uint16_t)(n - (atom_node_t *)nodes_memb.mem);
+}
+
+/*---------------------------------------------------------------------------*/
+/* The node's num_links links are contiguous from the returned pointer. They
+   may move when a link is added to any node. */
+atom_link_t *
+atom_net_node_links(atom_node_t *n)
+{
+  return &links[link_start[SLOT(n)]];
+}
+
+/*---------------------------------------------------------------------------*/
+atom_node_t *
+atom_net_link_dest(atom_link_t *l)
+{
+  return NODE_AT(l->dest_slot);
+}
+
 /*---------------------------------------------------------------------------*/
 atom_node_t *
 atom_net_node_heartbeat(uip_ipaddr_t *ipaddr)
@@ -275,6 +375,8 @@ atom_net_link_update(atom_node_t *src, sdn_node_id_t dest_id, int16_t rssi)
 {
   atom_node_t *dest;
   atom_link_t *l;
+  int16_t old_rssi = 0;
+  uint8_t added = 0;
   if(src != NULL) {
     if((dest = atom_net_get_node_id(dest_id)) == NULL) {
       /* Dest Node does not exist, so add the node based on id alone */
@@ -284,10 +386,18 @@ atom_net_link_update(atom_node_t *src, sdn_node_id_t dest_id, int16_t rssi)
     if((l = link_exists(src, dest)) == NULL) {
       /* If it doesn't already exist then we add it */
       l = link_add(src, dest);
+      added = 1;
     }
 
     /* Update the link information */
-    // l->rssi = rssi;
+    if(l != NULL) {
+      old_rssi = l->rssi;
+      l->rssi = rssi;
+      if(added || old_rssi != rssi) {
+        atom_link_updated(src, l, old_rssi,
+                          added ? ATOM_LINK_ADDED : ATOM_LINK_CHANGED);
+      }
+    }
     // l->last_update = clock_time();
     LOG_DBG( "LINK: Updated link\n");
     return l;
@@ -297,6 +407,33 @@ atom_net_link_update(atom_node_t *src, sdn_node_id_t dest_id, int16_t rssi)
   }
 }
 
+/*---------------------------------------------------------------------------*/
+void
+atom_net_link_rm(atom_node_t *src, sdn_node_id_t dest_id)
+{
+  atom_node_t *dest;
+  atom_link_t *l;
+  uint16_t pos, s;
+
+  if(src == NULL || (dest = atom_net_get_node_id(dest_id)) == NULL ||
+     (l = link_exists(src, dest)) == NULL) {
+    LOG_DBG("LINK: No link to remove\n");
+    return;
+  }
+  /* Apps see the link before it goes */
+  atom_link_updated(src, l, l->rssi, ATOM_LINK_REMOVED);
+  /* Close the gap, shifting the links of all following slots down by one */
+  pos = l - links;
+  memmove(&links[pos], &links[pos + 1],
+          (link_start[ATOM_MAX_NODES] - pos - 1) * sizeof(atom_link_t));
+  for(s = SLOT(src) + 1; s <= ATOM_MAX_NODES; s++) {
+    link_start[s]--;
+  }
+  src->num_links--;
+  LOG_DBG("LINK: Removed link (%d->%d)\n", src->id, dest_id);
+  LOG_ANNOTATE("#A l=%d/%d\n", link_start[ATOM_MAX_NODES], ATOM_MAX_LINKS);
+}
+
 /*---------------------------------------------------------------------------*/
 /* Print Functions */
 /*---------------------------------------------------------------------------*/
@@ -304,9 +441,10 @@ void
 print_node(atom_node_t *n)
 {
   int i;
+  atom_link_t *l = atom_net_node_links(n);
   LOG_DBG("Node[%d] - Links[", n->id);
   for(i = 0; i < n->num_links; i++) {
-    LOG_DBG_("%d,", n->links[i].dest_id);
+    LOG_DBG_("%d,", l[i].dest_id);
   }
   LOG_DBG_("] [");
   LOG_DBG_6ADDR(&n->ipaddr);
@@ -39,6 +39,9 @@
 #include <string.h>
 
 #include "contiki-net.h"
+#include "lib/memb.h"
+#include "lib/list.h"
+#include "lib/random.h"
 
 #include "sys/node-id.h"
 
@@ -64,17 +67,34 @@
 #define C_USDN_HDR              ((struct usdn_hdr *)&c_buf[cbuf_l3_udp_hdr_len])
 #define C_USDN_PAYLOAD          ((void *)&c_buf[cbuf_l3_udp_sdn_hdr_len])
 
-/* Outgoing packet buffer */
-static uint8_t              output_buf[80];
+/* Outgoing packet buffer (big enough for a hop-by-hop FTS) */
+static uint8_t              output_buf[96];
 #define C_USDN_OUT          ((uint8_t *)&output_buf)
 #define C_USDN_OUT_PAYLOAD  ((uint8_t *)&output_buf + USDN_H_LEN)
 
 /* udp connection */
 static struct simple_udp_connection udp;
 
+#if ATOM_TX_LEN
+/* FTS and CFG messages the node hasn't acked yet */
+typedef struct atom_tx {
+  struct atom_tx *next;
+  uip_ipaddr_t    dest;
+  uint8_t         tries;
+  clock_time_t    timeout;          /* Until we send it again */
+  struct ctimer   timer;
+  uint8_t         len;
+  uint8_t         buf[sizeof(output_buf)];
+} atom_tx_t;
+MEMB(tx_memb, atom_tx_t, ATOM_TX_LEN);
+LIST(tx_list);
+#endif /* ATOM_TX_LEN */
+/* Header flow of the last FTS or CFG we sent */
+static uint16_t tx_count;
+
 /*---------------------------------------------------------------------------*/
 usdn_hdr_t *
-usdn_set_header(void *buf, uint8_t net, uint8_t type, uint8_t flow)
+usdn_set_header(void *buf, uint8_t net, uint8_t type, uint16_t flow)
 {
   usdn_hdr_t *hdr = (usdn_hdr_t *)buf;
   hdr->net = net;
@@ -87,31 +107,106 @@ usdn_set_header(void *buf, uint8_t net, uint8_t type, uint8_t flow)
 /*---------------------------------------------------------------------------*/
 /* Message Handling In */
 /*---------------------------------------------------------------------------*/
-static atom_action_t *
-nsu_input(void) {
-  int i;
-  usdn_nsu_t *nsu = (usdn_nsu_t *)C_USDN_PAYLOAD;
+/* Each NSU record becomes a node in here */
+static uint8_t netupdate_buf[ATOM_ACTION_BUFSIZE];
 
-  atom_action_type_t action_type = ATOM_ACTION_NETUPDATE;
-  atom_netupdate_action_t action_data;
+/*---------------------------------------------------------------------------*/
+/* Add a node's NSU to the netupdate. Returns 0 if there's no room */
+static uint8_t
+nsu_node_add(atom_netupdate_action_t *nu, uip_ipaddr_t *ipaddr, usdn_nsu_t *nsu)
+{
+  int i, num_links;
+  atom_netupdate_node_t *node = (atom_netupdate_node_t *)&nu->nodes[nu->len];
 
-  LOG_DBG("NSU There are %d link updates for node [%u]",
+  LOG_DBG("NSU There are %d link updates for node [%u]\n",
            nsu->num_links,
-           C_IP_BUF->srcipaddr.u8[15]);
+           ipaddr->u8[15]);
+
+  if(nsu->ft_evicted > 0) {
+    LOG_WARN("NSU Node [%u] evicted %u flowtable entries\n",
+             ipaddr->u8[15], nsu->ft_evicted);
+  }
 
-  /* Get node info */
-  uip_ipaddr_copy(&action_data.node.ipaddr, &C_IP_BUF->srcipaddr);
-  action_data.node.cfg_id = nsu->cfg_id;
-  action_data.node.rank = nsu->rank;
   /* Get link info */
-  action_data.node.num_links = nsu->num_links;
-  // action_data.n_links = nsu->num_links;
-  for(i = 0; i < nsu->num_links; i++) {
-    action_data.node.links[i].dest_id = nsu->links[i].nbr_id;
-    action_data.node.links[i].rssi = nsu->links[i].rssi;
+  if(nsu->num_links > ATOM_MAX_LINKS_PER_NODE) {
+    LOG_ERR("NSU has %d links, only using %d\n",
+            nsu->num_links, ATOM_MAX_LINKS_PER_NODE);
+    num_links = ATOM_MAX_LINKS_PER_NODE;
+  } else {
+    num_links = nsu->num_links;
+  }
+  if(sizeof(atom_netupdate_action_t) + nu->len + sizeof(atom_netupdate_node_t) +
+     sizeof(atom_link_t) * num_links > ATOM_ACTION_BUFSIZE) {
+    LOG_ERR("NSU No room for node [%u]\n", ipaddr->u8[15]);
+    return 0;
+  }
+  /* Get node info */
+  uip_ipaddr_copy(&node->ipaddr, ipaddr);
+  node->cfg_id = nsu->cfg_id;
+  node->rank = nsu->rank;
+  node->seq = nsu->seq;
+  node->full = (nsu->flags & USDN_NSU_FULL) != 0;
+  node->more = (nsu->flags & USDN_NSU_MORE) != 0;
+  if(num_links < nsu->num_links) {
+    /* We'd prune the links we left out */
+    node->full = 0;
+  }
+  node->num_links = num_links;
+  for(i = 0; i < node->num_links; i++) {
+    node->links[i].dest_id = nsu->links[i].nbr_id;
+    node->links[i].rssi = nsu->links[i].rssi;
+    node->links[i].status = nsu->links[i].rssi == USDN_NSU_RSSI_REMOVED ?
+                            ATOM_LINK_REMOVED : ATOM_LINK_CHANGED;
   }
 
-  return atom_action_buf_copy_to(action_type, &action_data);
+  nu->num_nodes++;
+  nu->len += atom_netupdate_node_length(node);
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+static atom_action_t *
+nsu_input(void) {
+  atom_netupdate_action_t *nu = (atom_netupdate_action_t *)netupdate_buf;
+
+  nu->num_nodes = 0;
+  nu->len = 0;
+  nsu_node_add(nu, &C_IP_BUF->srcipaddr, (usdn_nsu_t *)C_USDN_PAYLOAD);
+
+  return atom_action_buf_copy_to(ATOM_ACTION_NETUPDATE, nu);
+}
+
+/*---------------------------------------------------------------------------*/
+static atom_action_t *
+nsu_agg_input(void) {
+  atom_netupdate_action_t *nu = (atom_netupdate_action_t *)netupdate_buf;
+  uint8_t *ptr = C_USDN_PAYLOAD;
+  uint8_t *end = &c_buf[c_len];
+  usdn_nsu_rec_t *rec;
+  uip_ipaddr_t ipaddr;
+
+  nu->num_nodes = 0;
+  nu->len = 0;
+  /* The records' nodes share the prefix of the node that sent them */
+  uip_ipaddr_copy(&ipaddr, &C_IP_BUF->srcipaddr);
+  while(ptr + sizeof(usdn_nsu_rec_t) <= end) {
+    rec = (usdn_nsu_rec_t *)ptr;
+    if(ptr + nsu_rec_length(rec) > end) {
+      LOG_ERR("NSUA Record is longer than the message\n");
+      break;
+    }
+    memcpy(&ipaddr.u8[sizeof(ipaddr.u8) - USDN_NSU_IID_LEN], rec->iid,
+           USDN_NSU_IID_LEN);
+    if(!nsu_node_add(nu, &ipaddr, &rec->nsu)) {
+      break;
+    }
+    ptr += nsu_rec_length(rec);
+  }
+
+  if(nu->num_nodes == 0) {
+    return NULL;
+  }
+  return atom_action_buf_copy_to(ATOM_ACTION_NETUPDATE, nu);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -138,6 +233,11 @@ ftq_input(void)
   atom_action_type_t action_type = ATOM_ACTION_ROUTING;
   atom_routing_action_t action_data;
 
+  if(ftq->length < sizeof(uip_ipaddr_t)) {
+    LOG_ERR("FTQ is too short for a dest (%u)\n", ftq->length);
+    return NULL;
+  }
+
   action_data.tx_id = ftq->tx_id;
   uip_ipaddr_copy(&action_data.src, &C_IP_BUF->srcipaddr);
   uip_ipaddr_copy(&action_data.dest, (uip_ip6addr_t *)ftq->data);
@@ -155,11 +255,160 @@ ftq_input(void)
   return atom_action_buf_copy_to(action_type, &action_data);
 }
 
+/*---------------------------------------------------------------------------*/
+/* Send the usdn packet in the output buffer */
+static void
+send(uip_ipaddr_t *dest, uint8_t len)
+{
+  usdn_hdr_t *hdr = (usdn_hdr_t *)output_buf;
+  /* Spit out some stats */
+  LOG_STAT("OUT %s s:%d d:%d id:%d\n",
+             USDN_CODE_STRING(hdr->typ),
+             node_id,
+             dest->u8[15],
+             hdr->flow);
+#if (SDN_CONTROLLER_TYPE == SDN_CONTROLLER_ATOM)
+  /* If we are the controller and we are sending to ourselves
+     then send straight to the engine */
+  if(uip_ds6_is_my_addr(dest)) {
+    LOG_DBG("Sending to SDN_ENGINE\n");
+    SDN_ENGINE.in(output_buf, len, NULL);
+    return;
+  }
+#endif
+  /* Send usdn packet over udp */
+  simple_udp_sendto(&udp,
+                    &output_buf,
+                    len,
+                    dest);
+}
+
+/*---------------------------------------------------------------------------*/
+#if ATOM_TX_LEN
+static void
+tx_free(atom_tx_t *tx)
+{
+  ctimer_stop(&tx->timer);
+  list_remove(tx_list, tx);
+  memb_free(&tx_memb, tx);
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+handle_tx_timer(void *ptr)
+{
+  atom_tx_t *tx = (atom_tx_t *)ptr;
+  usdn_hdr_t *hdr = (usdn_hdr_t *)tx->buf;
+
+  if(tx->tries >= ATOM_TX_TRIES) {
+    LOG_WARN("No CACK for %s id:%u from [%u], giving up\n",
+             USDN_CODE_STRING(hdr->typ), hdr->flow, tx->dest.u8[15]);
+    tx_free(tx);
+    return;
+  }
+  LOG_DBG("No CACK for %s id:%u from [%u], sending again\n",
+          USDN_CODE_STRING(hdr->typ), hdr->flow, tx->dest.u8[15]);
+  memcpy(output_buf, tx->buf, tx->len);
+  send(&tx->dest, tx->len);
+  tx->tries++;
+  tx->timeout *= 2;
+  ctimer_set(&tx->timer, tx->timeout, handle_tx_timer, tx);
+}
+
+/*---------------------------------------------------------------------------*/
+static atom_tx_t *
+tx_find(uip_ipaddr_t *dest, uint16_t flow)
+{
+  atom_tx_t *tx;
+  for(tx = list_head(tx_list); tx != NULL; tx = list_item_next(tx)) {
+    if(((usdn_hdr_t *)tx->buf)->flow == flow && uip_ipaddr_cmp(&tx->dest, dest)) {
+      return tx;
+    }
+  }
+  return NULL;
+}
+#endif /* ATOM_TX_LEN */
+
+/*---------------------------------------------------------------------------*/
+/* Send the FTS or CFG in the output buffer, and keep sending it until the
+   node acks it */
+static void
+send_reliable(uip_ipaddr_t *dest, uint8_t len)
+{
+  usdn_hdr_t *hdr = (usdn_hdr_t *)output_buf;
+#if ATOM_TX_LEN
+  atom_tx_t *tx, *next;
+#endif
+
+  /* The node acks using this, and ignores any it's already seen */
+  if(++tx_count == 0) {
+    ++tx_count;
+  }
+  hdr->flow = tx_count;
+  send(dest, len);
+
+#if ATOM_TX_LEN
+  /* Our own engine doesn't ack */
+  if(uip_ds6_is_my_addr(dest)) {
+    return;
+  }
+  for(tx = list_head(tx_list); tx != NULL; tx = next) {
+    next = list_item_next(tx);
+    /* A new CFG replaces the last one */
+    if(hdr->typ == USDN_MSG_CODE_CFG && uip_ipaddr_cmp(&tx->dest, dest) &&
+       ((usdn_hdr_t *)tx->buf)->typ == USDN_MSG_CODE_CFG) {
+      tx_free(tx);
+    }
+  }
+  if((tx = memb_alloc(&tx_memb)) == NULL) {
+    /* Make room by giving up on the oldest that's already been resent.
+       Messages still waiting on their first ack (e.g. the rest of a hop by
+       hop route) are kept */
+    for(tx = list_head(tx_list); tx != NULL && tx->tries < 2;
+        tx = list_item_next(tx));
+    if(tx == NULL) {
+      LOG_WARN("TX table full, sent id:%u once\n", hdr->flow);
+      return;
+    }
+    LOG_WARN("TX table full, giving up on id:%u\n", ((usdn_hdr_t *)tx->buf)->flow);
+    tx_free(tx);
+    tx = memb_alloc(&tx_memb);
+  }
+  uip_ipaddr_copy(&tx->dest, dest);
+  tx->len = len;
+  memcpy(tx->buf, output_buf, len);
+  tx->tries = 1;
+  tx->timeout = ATOM_TX_TIMEOUT;
+  ctimer_set(&tx->timer, tx->timeout, handle_tx_timer, tx);
+  list_add(tx_list, tx);
+#endif /* ATOM_TX_LEN */
+}
+
+/*---------------------------------------------------------------------------*/
+/* The node has our FTS or CFG (acked), or couldn't use it, so we're done */
+static void
+tx_input(usdn_hdr_t *hdr)
+{
+#if ATOM_TX_LEN
+  atom_tx_t *tx = tx_find(&C_IP_BUF->srcipaddr, hdr->flow);
+  if(tx == NULL) {
+    LOG_DBG("%s for id:%u isn't outstanding\n",
+            USDN_CODE_STRING(hdr->typ), hdr->flow);
+    return;
+  }
+  if(hdr->typ == USDN_MSG_CODE_CNACK) {
+    LOG_WARN("Node [%u] couldn't use %s id:%u\n", tx->dest.u8[15],
+             USDN_CODE_STRING(((usdn_hdr_t *)tx->buf)->typ), hdr->flow);
+  }
+  tx_free(tx);
+#endif /* ATOM_TX_LEN */
+}
+
 /*---------------------------------------------------------------------------*/
 /* Message Handling Out */
 /*---------------------------------------------------------------------------*/
 uint8_t
-cack_output(uint8_t net_id, uint8_t flow, void *buf)
+cack_output(uint8_t net_id, uint16_t flow, void *buf)
 {
   usdn_set_header(buf, net_id, USDN_MSG_CODE_CACK, flow);
 
@@ -168,7 +417,7 @@ cack_output(uint8_t net_id, uint8_t flow, void *buf)
 
 /*---------------------------------------------------------------------------*/
 static uint8_t
-cnack_output(uint8_t net_id, uint8_t flow, void *buf)
+cnack_output(uint8_t net_id, uint16_t flow, void *buf)
 {
   usdn_set_header(buf, net_id, USDN_MSG_CODE_CNACK, flow);
 
@@ -177,47 +426,209 @@ cnack_output(uint8_t net_id, uint8_t flow, void *buf)
 
 
 /*---------------------------------------------------------------------------*/
-// FIXME: This header is different from the other output functions
+/* Write the flowtable entry for a route to dest, returning its length */
 static uint8_t
-fts_output(uint8_t id, uip_ipaddr_t *dest, void *data)
+fts_route_entry(usdn_fts_entry_t *e, uip_ipaddr_t *dest,
+                atom_routing_response_t *response)
 {
-  /* Set the usdn header */
-  usdn_set_header(C_USDN_OUT, 0, USDN_MSG_CODE_FTS, id);
-  /* Set the usdn payload */
-  usdn_fts_t *fts = (usdn_fts_t *)C_USDN_OUT_PAYLOAD;
+  usdn_match_t *m = usdn_fts_match(e);
+  usdn_action_t *a;
 
   // TODO: Work out what type of query it was
 
-  /* Routing */
-  fts->tx_id = id;
-  fts->m.operator = EQ;
-  fts->m.index = uip_dst_index;
-  fts->m.len = sizeof(uip_ipaddr_t);
-  fts->m.req_ext = 0;
-  memcpy(&fts->m.data, dest, fts->m.len);
-  fts->a.action = SDN_FT_ACTION_SRH;
-  fts->a.index = 0;
-  fts->a.len = srh_route_length(((sdn_srh_route_t *)data));
-  memcpy(&fts->a.data, (sdn_srh_route_t *)data, 16);
+  /* Routing. The SRH ends at dest, so this can't cover other nodes */
+  m->operator = EQ;
+  m->index = uip_dst_index;
+  m->len = sizeof(uip_ipaddr_t);
+  m->req_ext = 0;
+  memcpy(m->data, dest, m->len);
+  /* The action goes straight after the match data */
+  a = usdn_fts_action(e);
+  a->index = 0;
+  if(response->route.length == 0) {
+    /* No route, have the node drop these packets for a while */
+    e->flags = USDN_FTS_NO_ROUTE;
+    a->action = SDN_FT_ACTION_DROP;
+    a->len = 0;
+  } else {
+    e->flags = 0;
+    a->action = SDN_FT_ACTION_SRH;
+    a->len = srh_route_length((&response->route));
+    memcpy(a->data, &response->route, a->len);
+  }
 
   /* Set this to be the default flowtable entry */
   // FIXME: Obviosuly we don't want this happening every time, and it Should
   //        depend upon the application...
 #if SDN_CONF_DEFAULT_FT_ENTRY
-  fts->is_default = 1;
-#else
-  fts->is_default = 0;
+  e->flags |= USDN_FTS_DEFAULT;
 #endif /* SDN_CONF_DEFAULT_FT_ENTRY */
+  e->priority = SDN_FT_PRIORITY_DEFAULT;
+
+  return usdn_fts_entry_length(e);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Number of bits set in an interface id wildcard (0 if there isn't one) */
+static uint8_t
+wildcard_bits(uint8_t *wildcard)
+{
+  uint8_t i, b, bits = 0;
+  for(i = 0; wildcard != NULL && i < ATOM_IID_LEN; i++) {
+    for(b = wildcard[i]; b != 0; b &= b - 1) {
+      bits++;
+    }
+  }
+  return bits;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Write a FORWARD entry for packets to dest, returning its length. If
+   wildcard isn't NULL, those bits of dest's interface id are ignored */
+static uint8_t
+fts_forward_entry(usdn_fts_entry_t *e, uip_ipaddr_t *dest, uip_ipaddr_t *nexthop,
+                  uint8_t *wildcard)
+{
+  uint8_t i, bits = wildcard_bits(wildcard);
+  uip_ipaddr_t ipaddr;
+  usdn_match_t *m = usdn_fts_match(e);
+  usdn_action_t *a;
+
+  e->flags = 0;
+  m->req_ext = 0;
+  if(bits == 0) {
+    m->operator = EQ;
+    m->index = uip_dst_index;
+    m->len = sizeof(uip_ipaddr_t);
+    memcpy(m->data, dest, m->len);
+  } else {
+    /* Match the interface id, as the value and mask don't fit for a full
+       address */
+    m->operator = MASK;
+    m->index = uip_dst_index + sizeof(uip_ipaddr_t) - ATOM_IID_LEN;
+    m->len = ATOM_IID_LEN;
+    for(i = 0; i < ATOM_IID_LEN; i++) {
+      m->data[ATOM_IID_LEN + i] = ~wildcard[i];
+      m->data[i] = dest->u8[sizeof(uip_ipaddr_t) - ATOM_IID_LEN + i] &
+                   ~wildcard[i];
+    }
+  }
+  /* The more bits an entry ignores, the lower its priority, so the most
+     specific one wins */
+  e->priority = SDN_FT_PRIORITY_DEFAULT - bits;
+  a = usdn_fts_action(e);
+  a->action = SDN_FT_ACTION_FORWARD;
+  a->index = uip_dst_index;
+  a->len = sizeof(uip_ipaddr_t);
+  /* Nodes forward to their neighbour's link-local address */
+  uip_ipaddr_copy(&ipaddr, nexthop);
+  uip_create_linklocal_prefix(&ipaddr);
+  memcpy(a->data, &ipaddr, a->len);
+
+  return usdn_fts_entry_length(e);
+}
+
+/*---------------------------------------------------------------------------*/
+// FIXME: This header is different from the other output functions
+static uint8_t
+fts_output(uint16_t id, uip_ipaddr_t *dest, atom_routing_response_t *response)
+{
+  /* Set the usdn header */
+  usdn_set_header(C_USDN_OUT, 0, USDN_MSG_CODE_FTS, id);
+  /* Set the usdn payload */
+  usdn_fts_t *fts = (usdn_fts_t *)C_USDN_OUT_PAYLOAD;
+  uint8_t len = USDN_H_LEN + sizeof(usdn_fts_t);
+
+  fts->tx_id = id;
+  fts->flags = USDN_FTS_REPLY;
+  fts->num_entries = 1;
+  len += fts_route_entry((usdn_fts_entry_t *)fts->entries, dest, response);
 
   // Debug
   // print_usdn_fts(fts);
 
-  return USDN_H_LEN + fts_length(fts);
+  return len;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Address of the i'th node on the route. The ends are the query's own
+   addresses, as nodes we only know from NSU links have no address. NULL if
+   we don't know it */
+static uip_ipaddr_t *
+hbh_node_addr(sdn_srh_route_t *route, int i, uip_ipaddr_t *src,
+              uip_ipaddr_t *dest)
+{
+  atom_node_t *node;
+  if(i == 0) {
+    return src;
+  }
+  if(i == route->length - 1) {
+    return dest;
+  }
+  node = atom_net_get_node_id(route->nodes[i]);
+  if(node == NULL || uip_is_addr_unspecified(&node->ipaddr)) {
+    return NULL;
+  }
+  return &node->ipaddr;
 }
 
 /*---------------------------------------------------------------------------*/
+/* Install a route hop-by-hop. Each node on the route gets one FTS, with a
+   FORWARD entry towards dest and one back towards src for the flow's return
+   traffic. Nodes furthest from src are sent theirs first, so the path is
+   there by the time src has its answer. src's FTS is left in the output
+   buffer and its length returned, or 0 (having sent nothing) if we don't
+   know the address of a node on the route */
 static uint8_t
-cfg_output(uint8_t net_id, uint8_t flow, void *buf) {
+hbh_output(uint16_t id, uip_ipaddr_t *src, uip_ipaddr_t *dest,
+           atom_routing_response_t *response)
+{
+  int i;
+  uint8_t *ptr = NULL;
+  uip_ipaddr_t *node, *next, *prev;
+  sdn_srh_route_t *route = &response->route;
+  usdn_fts_t *fts = (usdn_fts_t *)C_USDN_OUT_PAYLOAD;
+
+  for(i = 0; i < route->length; i++) {
+    if(hbh_node_addr(route, i, src, dest) == NULL) {
+      LOG_ERR("FTS node [%d] on the route to [%d] has no address\n",
+              route->nodes[i], dest->u8[15]);
+      return 0;
+    }
+  }
+  for(i = route->length - 1; i >= 0; i--) {
+    node = hbh_node_addr(route, i, src, dest);
+    next = i < route->length - 1 ? hbh_node_addr(route, i + 1, src, dest)
+                                 : NULL;
+    prev = i > 0 ? hbh_node_addr(route, i - 1, src, dest) : NULL;
+    /* Only src's FTS answers its query */
+    usdn_set_header(C_USDN_OUT, 0, USDN_MSG_CODE_FTS, 0);
+    fts->tx_id = i == 0 ? id : 0;
+    fts->flags = i == 0 ? USDN_FTS_REPLY : 0;
+    fts->num_entries = 0;
+    ptr = fts->entries;
+    if(next != NULL) {
+      /* Nodes ahead of the last relay can cover everything behind it */
+      ptr += fts_forward_entry((usdn_fts_entry_t *)ptr, dest, next,
+                               i < route->length - 2 ? response->wildcard
+                                                     : NULL);
+      fts->num_entries++;
+    }
+    if(prev != NULL) {
+      ptr += fts_forward_entry((usdn_fts_entry_t *)ptr, src, prev, NULL);
+      fts->num_entries++;
+    }
+    if(i > 0) {
+      send_reliable(node, ptr - C_USDN_OUT);
+    }
+  }
+
+  return ptr - C_USDN_OUT;
+}
+
+/*---------------------------------------------------------------------------*/
+static uint8_t
+cfg_output(uint8_t net_id, uint16_t flow, void *buf) {
   /* Set the usdn header */
   usdn_set_header(C_USDN_OUT, net_id, USDN_MSG_CODE_CFG, flow);
   /* Set the usdn payload */
@@ -271,6 +682,13 @@ init(void)
   /* Initialize UDP connection */
   simple_udp_register(&udp, ATOM_USDN_LPORT, NULL,
                       ATOM_USDN_RPORT, usdn_receive);
+#if ATOM_TX_LEN
+  memb_init(&tx_memb);
+  list_init(tx_list);
+#endif /* ATOM_TX_LEN */
+  /* So that a node doesn't take our first messages after a restart for ones
+     it's already had */
+  tx_count = random_rand();
   LOG_INFO("Atom sb usdn connector initialised\n");
 }
 
@@ -299,9 +717,16 @@ in(void) {
     case USDN_MSG_CODE_NSU:
       action = nsu_input();
       break;
+    case USDN_MSG_CODE_NSU_AGG:
+      action = nsu_agg_input();
+      break;
     case USDN_MSG_CODE_FTQ:
       action = ftq_input();
       break;
+    case USDN_MSG_CODE_CACK:
+    case USDN_MSG_CODE_CNACK:
+      tx_input(hdr);
+      break;
     default:
       LOG_ERR("Unknown usn msg (%u) from [", hdr->typ);
       LOG_ERR_6ADDR(&C_IP_BUF->srcipaddr);
@@ -315,9 +740,9 @@ in(void) {
     LOG_DBG("Action src [");
     LOG_DBG_6ADDR(&action->src);
     LOG_DBG_("]\n");
+    LOG_DBG("Calling apps with action %s\n", ACTION_STRING(action->type));
   }
 
-  LOG_DBG("Calling apps with action %s\n", ACTION_STRING(action->type));
   return action;
 }
 
@@ -326,10 +751,9 @@ static void
 out(atom_action_t *action, atom_response_t *response)
 {
   atom_routing_action_t *routing_action;
+  atom_routing_response_t *routing_response;
   /* Send length */
   uint8_t s_len = 0;
-  /* Set the usdn header */
-  usdn_hdr_t *hdr = (usdn_hdr_t *)output_buf;
 
   LOG_DBG("uSDN SB send response to");
   LOG_DBG_6ADDR(&response->dest);
@@ -342,8 +766,17 @@ out(atom_action_t *action, atom_response_t *response)
       if(action != NULL) {
         /* Dereference the action */
         routing_action = (atom_routing_action_t *)&action->data;
-        // TODO: How do we know this is action->dest? How do we know it's an FTS EQ?
-        s_len = fts_output(routing_action->tx_id, &routing_action->dest, response->data);
+        // TODO: How do we know this is action->dest?
+        routing_response = (atom_routing_response_t *)response->data;
+        if(routing_response->hop_by_hop) {
+          s_len = hbh_output(routing_action->tx_id, &response->dest,
+                             &routing_action->dest, routing_response);
+        }
+        if(s_len == 0) {
+          /* Source route it, also if it couldn't go hop-by-hop */
+          s_len = fts_output(routing_action->tx_id, &routing_action->dest,
+                             routing_response);
+        }
         break;
       }
     case ATOM_RESPONSE_ACK:
@@ -361,27 +794,11 @@ out(atom_action_t *action, atom_response_t *response)
   }
 
   /* Is there data to send? */
-  if(s_len > 0) {
-    /* Spit out some stats */
-    LOG_STAT("OUT %s s:%d d:%d id:%d\n",
-               USDN_CODE_STRING(hdr->typ),
-               node_id,
-               response->dest.u8[15],
-               hdr->flow);
-#if (SDN_CONTROLLER_TYPE == SDN_CONTROLLER_ATOM)
-  /* If we are the controller and we are sending to ourselves
-     then send straight to the engine */
-  if(uip_ds6_is_my_addr(&response->dest)) {
-    LOG_DBG("Sending to SDN_ENGINE\n");
-    SDN_ENGINE.in(output_buf, s_len, NULL);
-    return;
-  }
-#endif
-  /* Send usdn packet over udp */
-  simple_udp_sendto(&udp,
-                    &output_buf,
-                    s_len,
-                    &response->dest);
+  if(s_len > 0 && (response->type == ATOM_RESPONSE_ROUTING ||
+                   response->type == ATOM_RESPONSE_CFG)) {
+    send_reliable(&response->dest, s_len);
+  } else if(s_len > 0) {
+    send(&response->dest, s_len);
   } else {
     LOG_ERR("Error in OUT");
   }
@@ -101,29 +101,76 @@ get_num_apps(atom_app_ptr_t matrix[][NUM_ATOM_ACTIONS], atom_action_t *action)
   return i;
 }
 
+/*---------------------------------------------------------------------------*/
+static void
+do_node_update(atom_netupdate_node_t *nu)
+{
+  int i;
+  atom_node_t *n;
+  atom_link_t link, *l;
+
+  /* Update node */
+  n = atom_net_node_update(&nu->ipaddr, nu->cfg_id, nu->rank);
+  if(n == NULL) {
+    return;
+  }
+  l = atom_net_node_links(n);
+  if(nu->full) {
+    if(!n->nsu_resync) {
+      /* Any link not in a full update (or its later parts) has gone */
+      for(i = 0; i < n->num_links; i++) {
+        l[i].status = ATOM_LINK_REMOVED;
+      }
+      n->nsu_synced = 1;
+    } else if(nu->seq != (uint8_t)(n->nsu_seq + 1)) {
+      /* Missed a part, so we can't tell which links have gone */
+      LOG_WARN("NSU Missed part of a full update from [%d]\n", n->id);
+      n->nsu_synced = 0;
+    }
+  } else if(n->nsu_resync) {
+    /* The rest of a full update never came */
+    n->nsu_synced = 0;
+  } else if(n->nsu_synced && nu->seq != (uint8_t)(n->nsu_seq + 1)) {
+    /* We'll be out of step until the next full update */
+    LOG_WARN("NSU Missed an update from [%d] (seq %d after %d)\n",
+             n->id, nu->seq, n->nsu_seq);
+    n->nsu_synced = 0;
+  }
+  n->nsu_seq = nu->seq;
+  n->nsu_resync = nu->full && nu->more;
+  for(i = 0; i < nu->num_links; i++) {
+    /* Update link */
+    memcpy(&link, &nu->links[i], sizeof(atom_link_t));
+    if(link.status == ATOM_LINK_REMOVED) {
+      atom_net_link_rm(n, link.dest_id);
+    } else if((l = atom_net_link_update(n, link.dest_id, link.rssi)) != NULL) {
+      l->status = ATOM_LINK_CHANGED;
+    }
+  }
+  if(nu->full && !nu->more && n->nsu_synced) {
+    /* Have the whole full update, prune the links it didn't list */
+    l = atom_net_node_links(n);
+    for(i = n->num_links; i > 0; i--) {
+      if(l[i - 1].status == ATOM_LINK_REMOVED) {
+        atom_net_link_rm(n, l[i - 1].dest_id);
+      }
+    }
+  }
+}
+
 /*---------------------------------------------------------------------------*/
 static void
 do_net_update(atom_action_t *action, void *data)
 {
   int i;
-  atom_node_t *node, *n;
-  atom_link_t link;
 
   /* Dereference the action data */
   atom_netupdate_action_t *nu = (atom_netupdate_action_t *)data;
+  atom_netupdate_node_t *node = (atom_netupdate_node_t *)nu->nodes;
 
-  node = &nu->node;
-
-  if(node != NULL){
-    /* Update node */
-    n = atom_net_node_update(&action->src, node->cfg_id, node->rank);
-    if(n != NULL && node->num_links > 0) {
-      for(i = 0; i < node->num_links; i++) {
-        /* Update link */
-        memcpy(&link, &node->links[i], sizeof(atom_link_t));
-        atom_net_link_update(n, link.dest_id, link.rssi);
-      }
-    }
+  for(i = 0; i < nu->num_nodes; i++) {
+    do_node_update(node);
+    node = atom_netupdate_node_next(node);
   }
 }
 
@@ -158,6 +205,20 @@ atom_init(uip_ipaddr_t *addr)
   process_start(&controller_process, NULL);
 }
 
+/*---------------------------------------------------------------------------*/
+void
+atom_link_updated(atom_node_t *src, atom_link_t *link,
+                  int16_t old_rssi, uint8_t change)
+{
+  int i;
+  /* Let any apps caching state on the topology know it's changed */
+  for(i = 0; i < NUM_APPS; i++) {
+    if(all_apps[i]->link_update != NULL) {
+      all_apps[i]->link_update(src, link, old_rssi, change);
+    }
+  }
+}
+
 /*---------------------------------------------------------------------------*/
 void
 atom_post(struct atom_sb *sb)
@@ -251,9 +312,8 @@ atom_run(struct atom_sb *sb)
   /* Get the action from the sb */
   atom_action_t *action = sb->in();
 
-  LOG_DBG("Running %s action\n", ACTION_STRING(action->type));
-
   if(action != NULL) {
+    LOG_DBG("Running %s action\n", ACTION_STRING(action->type));
     /* Get the apps for that action */
     LOG_DBG("Get %s applications\n", ACTION_STRING(action->type));
     atom_app_ptr_t *apps = get_apps(sb->app_matrix, action);
@@ -303,7 +363,7 @@ atom_run(struct atom_sb *sb)
     }
 
   } else {
-    LOG_ERR("Action was NULL!\n");
+    LOG_DBG("Action was NULL!\n");
   }
 }
 
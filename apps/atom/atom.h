@@ -97,10 +97,19 @@ extern uip_ipaddr_t controller_addr;
 /* Max number of links per monitored node */
 #define ATOM_MAX_LINKS_PER_NODE  NBR_TABLE_CONF_MAX_NEIGHBORS
 
+/* Link changes, for atom_link_updated() and the status of links in a
+   netupdate */
+#define ATOM_LINK_CHANGED        0
+#define ATOM_LINK_ADDED          1
+#define ATOM_LINK_REMOVED        2
+
 typedef struct atom_link {
-  uint8_t dest_id;
-  int16_t rssi;
-  uint8_t status;
+  sdn_node_id_t dest_id;
+  uint16_t      dest_slot;        /* slot of the dest node (net layer only) */
+  int16_t       rssi;
+  uint8_t       status;           /* ATOM_LINK_x in a netupdate. In the net
+                                     layer, REMOVED while a full update that
+                                     hasn't listed the link yet is coming */
 } atom_link_t;
 
 typedef struct atom_handshake {
@@ -117,18 +126,25 @@ typedef struct atom_node {
   uint8_t          cfg_id;        /* configuration id */
   atom_hs_t        handshake;     /* Handshake to ensure node response */
   uint8_t          rank;          /* rank of the node */
-  /* Neighbors */
+  uint8_t          nsu_seq;       /* seq of the last NSU */
+  uint8_t          nsu_synced;    /* Have all NSUs since the last full one */
+  uint8_t          nsu_resync;    /* A full update's parts are coming */
+  /* Neighbors. See atom_net_node_links(). */
   uint8_t          num_links;
-  atom_link_t      links[ATOM_MAX_LINKS_PER_NODE];
 } atom_node_t;
 
 /* Network Layer API */
 void atom_net_init(void);
 atom_node_t *atom_net_get_node_ipaddr(uip_ipaddr_t *ipaddr);
 atom_node_t *atom_net_get_node_id(sdn_node_id_t id);
+atom_node_t *atom_net_get_nodes(void);
+uint16_t atom_net_node_slot(atom_node_t *n);
+atom_link_t *atom_net_node_links(atom_node_t *n);
+atom_node_t *atom_net_link_dest(atom_link_t *l);
 atom_node_t *atom_net_node_heartbeat(uip_ipaddr_t *ipaddr);
 atom_node_t *atom_net_node_update(uip_ipaddr_t *ipaddr, uint8_t cfg_id, uint8_t rank);
 atom_link_t *atom_net_link_update(atom_node_t *src, sdn_node_id_t dest_id, int16_t rssi);
+void atom_net_link_rm(atom_node_t *src, sdn_node_id_t dest_id);
 
 /*---------------------------------------------------------------------------*/
 /* Appliction Layer */
@@ -142,13 +158,34 @@ typedef enum ATOM_ACTION_TYPE {
 } atom_action_type_t;
 
 typedef struct atom_routing_action {
-  uint8_t      tx_id; // FIXME: Should really be using id in action
+  uint16_t     tx_id; // FIXME: Should really be using id in action
   uip_ipaddr_t src;
   uip_ipaddr_t dest;
 } atom_routing_action_t;
 
+/* One node's update. num_links links follow it */
+typedef struct atom_netupdate_node {
+  uip_ipaddr_t ipaddr;
+  uint8_t     cfg_id;
+  uint8_t     rank;
+  uint8_t     seq;
+  uint8_t     full;               /* links are all of the node's links,
+                                     rather than the ones that changed */
+  uint8_t     more;               /* the rest of a full update's links
+                                     follow in the node's next updates */
+  uint8_t     num_links;
+  atom_link_t links[];
+} atom_netupdate_node_t;
+#define atom_netupdate_node_length(n) (sizeof(atom_netupdate_node_t) + \
+                                       sizeof(atom_link_t) * (n)->num_links)
+#define atom_netupdate_node_next(n) ((atom_netupdate_node_t *) \
+                                     ((uint8_t *)(n) + atom_netupdate_node_length(n)))
+
 typedef struct atom_netupdate_action {
-  atom_node_t node;
+  uint8_t     num_nodes;
+  uint8_t     len;                /* Bytes of nodes */
+  uint8_t     nodes[];            /* atom_netupdate_node_t, back to back. More
+                                     than one if NSUs were aggregated */
 } atom_netupdate_action_t;
 
 typedef struct atom_join_action {
@@ -176,8 +213,18 @@ typedef enum ATOM_RESPONSE_TYPE {
   NUM_ATOM_RESPONSES
 } atom_response_type_t;
 
+/* Length of the interface id, in the low half of an ipaddr */
+#define ATOM_IID_LEN    8
+
 typedef struct atom_routing_response {
-  sdn_srh_route_t route;
+  sdn_srh_route_t route;          /* Empty if there's no route */
+  uint8_t         wildcard[ATOM_IID_LEN];  /* Bits of the destination's
+                                     interface id that hop by hop entries
+                                     ahead of the last relay ignore, so they
+                                     cover the nodes behind it (0 for none) */
+  uint8_t         hop_by_hop;     /* Install FORWARD entries on every node on
+                                     the route, rather than an SRH at the
+                                     source */
 } atom_routing_response_t;
 
 // TODO: atom_configure_response
@@ -197,6 +244,10 @@ struct atom_app {
   atom_action_type_t action_type;         /* Action type the app handles */
   void               (* init)(void);
   atom_response_t *  (* run)(void *data);
+  /* Optional. Called whenever a link is added, is about to be removed, or
+     its RSSI is updated. change is ATOM_LINK_x */
+  void               (* link_update)(atom_node_t *src, atom_link_t *link,
+                                     int16_t old_rssi, uint8_t change);
 };
 #define atom_app_ptr_t struct atom_app *
 
@@ -229,7 +280,7 @@ struct atom_sb sb_usdn;
 struct atom_sb sb_rpl;
 
 /* Prototypes of SB output functions to make them visible to other connectors */
-uint8_t cack_output(uint8_t net_id, uint8_t flow, void *buf);
+uint8_t cack_output(uint8_t net_id, uint16_t flow, void *buf);
 
 /*---------------------------------------------------------------------------*/
 /* Atom buffer */
@@ -288,6 +339,8 @@ void atom_response_buf_clear(void);
 void atom_init(uip_ipaddr_t *addr);
 void atom_post(struct atom_sb *sb);
 void atom_run(struct atom_sb *sb);
+void atom_link_updated(atom_node_t *src, atom_link_t *link,
+                       int16_t old_rssi, uint8_t change);
 void atom_set_handshake_timer(sdn_tmr_state_t state,
                               uint8_t type,
                               struct ctimer *timer,
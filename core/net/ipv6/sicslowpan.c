@@ -214,6 +214,15 @@ static uint8_t uncomp_hdr_len;
  * the result of the last transmitted fragment
  */
 static int last_tx_status;
+
+#if UIP_CONF_IPV6_SDN
+/**
+ * An extension header to send straight after the IPv6 header, which isn't
+ * in uip_buf. uip_len includes it. See sicslowpan_set_ext_hdr().
+ */
+static const uint8_t *ext_hdr;
+static uint8_t ext_hdr_len;
+#endif /* UIP_CONF_IPV6_SDN */
 /** @} */
 
 
@@ -1285,6 +1294,58 @@ static void
   watchdog_periodic();
 }
 /*--------------------------------------------------------------------*/
+#if UIP_CONF_IPV6_SDN
+/**
+ * \brief Copy part of the outgoing IP packet into the packetbuf,
+ * gathering in the extension header if one has been set.
+ * \param dst Where to copy to
+ * \param offset Offset into the IP packet
+ * \param len Number of bytes to copy
+ */
+static void
+copy_ip_out(uint8_t *dst, uint16_t offset, uint16_t len)
+{
+  uint16_t n;
+
+  if(ext_hdr_len > 0) {
+    /* IPv6 header */
+    if(offset < UIP_IPH_LEN) {
+      n = UIP_IPH_LEN - offset < len ? UIP_IPH_LEN - offset : len;
+      memcpy(dst, (uint8_t *)UIP_IP_BUF + offset, n);
+      dst += n; offset += n; len -= n;
+    }
+    /* Extension header */
+    if(offset < UIP_IPH_LEN + ext_hdr_len) {
+      n = UIP_IPH_LEN + ext_hdr_len - offset < len ?
+          UIP_IPH_LEN + ext_hdr_len - offset : len;
+      memcpy(dst, ext_hdr + offset - UIP_IPH_LEN, n);
+      dst += n; offset += n; len -= n;
+    }
+    /* The rest of the packet follows the IPv6 header in uip_buf */
+    offset -= ext_hdr_len;
+  }
+  memcpy(dst, (uint8_t *)UIP_IP_BUF + offset, len);
+}
+/*--------------------------------------------------------------------*/
+/**
+ * \brief Send an extension header after the IPv6 header without it having
+ * to be inserted into uip_buf. The caller sets up the IPv6 header and
+ * uip_len as if it had been, and clears it again (NULL) after output.
+ * Headers which are compressed (UDP) can't be used with this.
+ * \param hdr The extension header
+ * \param len Length of the extension header
+ */
+void
+sicslowpan_set_ext_hdr(const uint8_t *hdr, uint8_t len)
+{
+  ext_hdr = hdr;
+  ext_hdr_len = hdr != NULL ? len : 0;
+}
+#else /* UIP_CONF_IPV6_SDN */
+#define copy_ip_out(dst, offset, len) \
+  memcpy(dst, (uint8_t *)UIP_IP_BUF + (offset), len)
+#endif /* UIP_CONF_IPV6_SDN */
+/*--------------------------------------------------------------------*/
 /** \brief Take an IP packet and format it to be sent on an 802.15.4
  *  network using 6lowpan.
  *  \param localdest The MAC address of the destination
@@ -1441,8 +1502,8 @@ output(const uip_lladdr_t *localdest)
     packetbuf_hdr_len += SICSLOWPAN_FRAG1_HDR_LEN;
     packetbuf_payload_len = (max_payload - packetbuf_hdr_len) & 0xfffffff8;
     PRINTFO("(len %d, tag %d)\n", packetbuf_payload_len, frag_tag);
-    memcpy(packetbuf_ptr + packetbuf_hdr_len,
-           (uint8_t *)UIP_IP_BUF + uncomp_hdr_len, packetbuf_payload_len);
+    copy_ip_out(packetbuf_ptr + packetbuf_hdr_len,
+                uncomp_hdr_len, packetbuf_payload_len);
     packetbuf_set_datalen(packetbuf_payload_len + packetbuf_hdr_len);
     q = queuebuf_new_from_packetbuf();
     if(q == NULL) {
@@ -1491,8 +1552,8 @@ output(const uip_lladdr_t *localdest)
       }
       PRINTFO("(offset %d, len %d, tag %d)\n",
              processed_ip_out_len >> 3, packetbuf_payload_len, frag_tag);
-      memcpy(packetbuf_ptr + packetbuf_hdr_len,
-             (uint8_t *)UIP_IP_BUF + processed_ip_out_len, packetbuf_payload_len);
+      copy_ip_out(packetbuf_ptr + packetbuf_hdr_len,
+                  processed_ip_out_len, packetbuf_payload_len);
       packetbuf_set_datalen(packetbuf_payload_len + packetbuf_hdr_len);
       q = queuebuf_new_from_packetbuf();
       if(q == NULL) {
@@ -1527,8 +1588,8 @@ output(const uip_lladdr_t *localdest)
      * The packet does not need to be fragmented
      * copy "payload" and send
      */
-    memcpy(packetbuf_ptr + packetbuf_hdr_len, (uint8_t *)UIP_IP_BUF + uncomp_hdr_len,
-           uip_len - uncomp_hdr_len);
+    copy_ip_out(packetbuf_ptr + packetbuf_hdr_len, uncomp_hdr_len,
+                uip_len - uncomp_hdr_len);
     packetbuf_set_datalen(uip_len - uncomp_hdr_len + packetbuf_hdr_len);
 #if UIP_CONF_IPV6_SDN
     send_packet(&dest, packet_type);
@@ -320,6 +320,9 @@ struct sicslowpan_nh_compressor {
 };
 
 int sicslowpan_get_last_rssi(void);
+#if UIP_CONF_IPV6_SDN
+void sicslowpan_set_ext_hdr(const uint8_t *hdr, uint8_t len);
+#endif /* UIP_CONF_IPV6_SDN */
 
 extern const struct network_driver sicslowpan_driver;
 
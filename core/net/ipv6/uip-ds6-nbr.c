@@ -51,6 +51,9 @@
 #include "net/linkaddr.h"
 #include "net/packetbuf.h"
 #include "net/ipv6/uip-ds6-nbr.h"
+#if UIP_CONF_IPV6_SDN
+#include "net/sdn/sdn.h"
+#endif
 
 #define DEBUG DEBUG_NONE
 #include "net/ip/uip-debug.h"
@@ -111,6 +114,9 @@ uip_ds6_nbr_add(const uip_ipaddr_t *ipaddr, const uip_lladdr_t *lladdr,
     PRINTLLADDR(lladdr);
     PRINTF(" state %u\n", state);
     NEIGHBOR_STATE_CHANGED(nbr);
+#if UIP_CONF_IPV6_SDN
+    SDN_DRIVER.nbr_added(nbr);
+#endif /* UIP_CONF_IPV6_SDN */
     return nbr;
   } else {
     PRINTF("uip_ds6_nbr_add drop ip addr ");
@@ -131,6 +137,9 @@ uip_ds6_nbr_rm(uip_ds6_nbr_t *nbr)
     uip_packetqueue_free(&nbr->packethandle);
 #endif /* UIP_CONF_IPV6_QUEUE_PKT */
     NEIGHBOR_STATE_CHANGED(nbr);
+#if UIP_CONF_IPV6_SDN
+    SDN_DRIVER.nbr_removed(nbr);
+#endif /* UIP_CONF_IPV6_SDN */
     return nbr_table_remove(ds6_neighbors, nbr);
   }
   return 0;
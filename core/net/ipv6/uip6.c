@@ -1219,6 +1219,17 @@ uip_process(uint8_t flag)
           return;    /* Return to calling process and don't clear the buf */
       }
   }
+#if SDN_CONF_NSU_AGGREGATE_WINDOW
+  if( *uip_next_hdr == UIP_PROTO_UDP &&
+      !uip_ds6_is_my_addr(&UIP_IP_BUF->destipaddr) &&
+      uip_ipaddr_cmp(&UIP_IP_BUF->destipaddr, &DEFAULT_CONTROLLER->ipaddr)) {
+    PRINTF("uip6: Checking SDN for controller\n");
+    /* We may hold it to send on with our own messages */
+    if(SDN_DRIVER.process(SDN_CTRL) == UIP_DROP) {
+      goto drop;
+    }
+  }
+#endif /* SDN_CONF_NSU_AGGREGATE_WINDOW */
   if( *uip_next_hdr != UIP_PROTO_ICMP6 &&
       !uip_ds6_is_my_addr(&UIP_IP_BUF->destipaddr) &&
       !uip_ipaddr_cmp(&UIP_IP_BUF->destipaddr, &DEFAULT_CONTROLLER->ipaddr) &&
@@ -63,6 +63,79 @@
 #ifndef SDN_CONF_RETRY_AFTER_QUERY
 #define SDN_CONF_RETRY_AFTER_QUERY          0
 #endif
+/* Work out the SRH wire bytes when a SRH entry is installed, rather than
+   for every packet */
+#ifndef SDN_CONF_SRH_PRECOMPILE
+#define SDN_CONF_SRH_PRECOMPILE             1
+#endif
+/* Have 6LoWPAN send precompiled SRHs after the IPv6 header, rather than
+   moving the payload in uip_buf to make space for them */
+#ifndef SDN_CONF_SRH_GATHER
+#define SDN_CONF_SRH_GATHER                 1
+#endif
+/* While a query is outstanding, send the packet up the RPL default route
+   rather than holding it until the controller answers */
+#ifndef SDN_CONF_SPECULATIVE_FWD
+#define SDN_CONF_SPECULATIVE_FWD            0
+#endif
+/* Lifetime of the drop entry installed when the controller has no route for
+   a query. It doubles each time the controller still has no route when we ask
+   again, up to the max */
+#ifndef SDN_CONF_NO_ROUTE_LIFETIME
+#define SDN_CONF_NO_ROUTE_LIFETIME          (CLOCK_SECOND * 4)
+#endif
+#ifndef SDN_CONF_NO_ROUTE_MAX_LIFETIME
+#define SDN_CONF_NO_ROUTE_MAX_LIFETIME      (CLOCK_SECOND * 128)
+#endif
+/* Number of unroutable queries to remember the backoff of. 0 to always use
+   SDN_CONF_NO_ROUTE_LIFETIME */
+#ifndef SDN_CONF_NO_ROUTE_TABLE_LEN
+#define SDN_CONF_NO_ROUTE_TABLE_LEN         4
+#endif
+/* Send the full list of links in every this many NSUs, and only the links
+   that have been added, removed or changed in between. 1 for a full list
+   every time */
+#ifndef SDN_CONF_NSU_FULL_PERIOD
+#define SDN_CONF_NSU_FULL_PERIOD            5
+#endif
+/* How far (dBm) a link's RSSI has to move from the last one sent before it's
+   sent again */
+#ifndef SDN_CONF_NSU_RSSI_HYSTERESIS
+#define SDN_CONF_NSU_RSSI_HYSTERESIS        3
+#endif
+/* Send NSUs on a trickle timer: the period is halved this many times after
+   the neighbourhood changes, and doubles back up to the update period while
+   it stays the same. 0 for a fixed period */
+#ifndef SDN_CONF_NSU_TRICKLE_DOUBLINGS
+#define SDN_CONF_NSU_TRICKLE_DOUBLINGS      4
+#endif
+/* Hold NSUs from other nodes on their way through us to the controller for
+   this many clock ticks (e.g. CLOCK_SECOND / 4), and send them on together
+   with ours. Unlike the update period this isn't in seconds, as it should be
+   well under one. 0 to forward them as they come */
+#ifndef SDN_CONF_NSU_AGGREGATE_WINDOW
+#define SDN_CONF_NSU_AGGREGATE_WINDOW       0
+#endif
+/* Most bytes of held NSUs to send in one go */
+#ifndef SDN_CONF_NSU_AGGREGATE_LEN
+#define SDN_CONF_NSU_AGGREGATE_LEN          80
+#endif
+/* Number of recent FTS/CFG ids from the controller to remember. We ack each
+   one (CACK) so the controller stops resending it, and only apply it the first
+   time. 0 to never ack */
+#ifndef SDN_CONF_ACK_CONTROLLER
+#define SDN_CONF_ACK_CONTROLLER             4
+#endif
+/* Number of outstanding queries to remember. Packets with the same query
+   bytes as an outstanding query are buffered against it rather than sending
+   another ftq. 0 to send a ftq for every packet. */
+#ifndef SDN_CONF_QUERY_TABLE_LEN
+#define SDN_CONF_QUERY_TABLE_LEN            4
+#endif
+/* Max query length we can remember (longer queries are never coalesced) */
+#ifndef SDN_CONF_QUERY_KEY_LEN
+#define SDN_CONF_QUERY_KEY_LEN              16
+#endif
 
 /*---------------------------------------------------------------------------*/
 /* Default settings for SDN configuration data structure */
@@ -43,6 +43,8 @@
 #include "net/rpl/rpl-private.h"
 
 #include "net/sdn/sdn.h"
+#include "net/sdn/sdn-conf.h"
+#include "net/ipv6/sicslowpan.h"
 
 /* Log configuration */
 #include "sys/log-ng.h"
@@ -57,6 +59,12 @@
 #define UIP_RH_BUF                ((struct uip_routing_hdr *)&uip_buf[uip_l2_l3_hdr_len])
 #define UIP_RPL_SRH_BUF           ((struct uip_sdn_srh_hdr *)&uip_buf[uip_l2_l3_hdr_len + RPL_RH_LEN])
 
+#if SDN_CONF_SRH_GATHER
+/* SRH sent by 6LoWPAN after the IPv6 header of the current packet */
+static uint8_t srh_attached[SDN_SRH_COMPILED_MAX];
+static uint8_t srh_attached_len;
+#endif /* SDN_CONF_SRH_GATHER */
+
 /*---------------------------------------------------------------------------*/
 int
 sdn_ext_insert_srh(sdn_srh_route_t *route)
@@ -160,3 +168,147 @@ sdn_ext_insert_srh(sdn_srh_route_t *route)
 
   return 1;
 }
+/*---------------------------------------------------------------------------*/
+/* Builds the SRH for a route into buf, as a sdn_srh_compiled_t. Only fully
+   compressed routes (cmpr 15) are compiled, as the hop bytes then don't
+   depend on the packet. Returns the number of bytes used, or 0. */
+uint8_t
+sdn_ext_compile_srh(sdn_srh_route_t *route, uint8_t *buf)
+{
+  sdn_srh_compiled_t *srh = (sdn_srh_compiled_t *)buf;
+  uint8_t path_len;
+  uint8_t ext_len;
+  uint8_t padding;
+  int i;
+
+  if(route->cmpr != 15 ||
+     route->length < 2 || route->length > SDN_CONF_MAX_ROUTE_LEN) {
+    return 0;
+  }
+
+  path_len = route->length - 1;
+  ext_len = RPL_RH_LEN + RPL_SRH_LEN + path_len;
+  padding = ext_len % 8 == 0 ? 0 : (8 - (ext_len % 8));
+  ext_len += padding;
+
+  memset(srh->hdr, 0, ext_len);
+  srh->ext_len = ext_len;
+  srh->dest_lsb = (uint8_t)route->nodes[1];
+  /* Routing header (next is filled in per packet) */
+  srh->hdr[1] = (ext_len - 8) / 8;
+  srh->hdr[2] = SDN_RH_TYPE_SRH;
+  srh->hdr[3] = path_len;
+  /* SDN source routing header */
+  srh->hdr[RPL_RH_LEN] = (route->cmpr << 4) + route->cmpr;
+  srh->hdr[RPL_RH_LEN + 1] = padding << 4;
+  /* Hops, first to last */
+  for(i = 1; i < route->length; i++) {
+    srh->hdr[RPL_RH_LEN + RPL_SRH_LEN + i - 1] = (uint8_t)route->nodes[i];
+  }
+
+  return sizeof(sdn_srh_compiled_t) + ext_len;
+}
+/*---------------------------------------------------------------------------*/
+int
+sdn_ext_insert_srh_compiled(sdn_srh_compiled_t *srh)
+{
+  uint8_t temp_len;
+  uint8_t ext_len = srh->ext_len;
+
+  /* Check if there is enough space to store the extension header */
+  if(uip_len + ext_len > UIP_BUFSIZE) {
+    LOG_ERR("INSERT Packet too long: can't add source routing header (%u bytes)\n", ext_len);
+    return 1;
+  }
+
+  /* Move existing ext headers and payload uip_ext_len further */
+  memmove(uip_buf + uip_l2_l3_hdr_len + ext_len,
+      uip_buf + uip_l2_l3_hdr_len, uip_len - UIP_IPH_LEN);
+  memcpy(uip_buf + uip_l2_l3_hdr_len, srh->hdr, ext_len);
+
+  /* Insert source routing header */
+  UIP_RH_BUF->next = UIP_IP_BUF->proto;
+  UIP_IP_BUF->proto = UIP_PROTO_ROUTING;
+
+  /* The next hop is placed as the current IPv6 destination */
+  UIP_IP_BUF->destipaddr.u8[15] = srh->dest_lsb;
+
+  /* In-place update of IPv6 length field */
+  temp_len = UIP_IP_BUF->len[1];
+  UIP_IP_BUF->len[1] += ext_len;
+  if(UIP_IP_BUF->len[1] < temp_len) {
+    UIP_IP_BUF->len[0]++;
+  }
+
+  uip_ext_len = ext_len;
+  uip_len += ext_len;
+
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* As sdn_ext_insert_srh_compiled(), but the payload isn't moved. A copy of
+   the SRH, already processed for the first hop, is handed to 6LoWPAN to
+   send after the IPv6 header. uip_buf can then only be sent until
+   sdn_ext_detach_srh() is called. Returns 0 if it can't be attached. */
+int
+sdn_ext_attach_srh_compiled(sdn_srh_compiled_t *srh)
+{
+#if SDN_CONF_SRH_GATHER
+  uint8_t temp_len;
+  uint8_t ext_len = srh->ext_len;
+
+  /* Only the IPv6 header can be ahead of it */
+  if(uip_ext_len > 0 || srh_attached_len > 0) {
+    return 0;
+  }
+  if(uip_len + ext_len > UIP_BUFSIZE) {
+    LOG_ERR("INSERT Packet too long: can't add source routing header (%u bytes)\n", ext_len);
+    return 0;
+  }
+
+  memcpy(srh_attached, srh->hdr, ext_len);
+  srh_attached[0] = UIP_IP_BUF->proto;
+  UIP_IP_BUF->proto = UIP_PROTO_ROUTING;
+  /* The first hop is both the destination and the first address, so
+     processing it for the first hop just means one less segment left */
+  UIP_IP_BUF->destipaddr.u8[15] = srh->dest_lsb;
+  srh_attached[3]--;
+
+  /* In-place update of IPv6 length field */
+  temp_len = UIP_IP_BUF->len[1];
+  UIP_IP_BUF->len[1] += ext_len;
+  if(UIP_IP_BUF->len[1] < temp_len) {
+    UIP_IP_BUF->len[0]++;
+  }
+
+  uip_ext_len = ext_len;
+  uip_len += ext_len;
+
+  srh_attached_len = ext_len;
+  sicslowpan_set_ext_hdr(srh_attached, ext_len);
+  return 1;
+#else
+  return 0;
+#endif /* SDN_CONF_SRH_GATHER */
+}
+/*---------------------------------------------------------------------------*/
+void
+sdn_ext_detach_srh(void)
+{
+#if SDN_CONF_SRH_GATHER
+  if(srh_attached_len > 0) {
+    sicslowpan_set_ext_hdr(NULL, 0);
+    srh_attached_len = 0;
+  }
+#endif /* SDN_CONF_SRH_GATHER */
+}
+/*---------------------------------------------------------------------------*/
+uint8_t
+sdn_ext_srh_attached(void)
+{
+#if SDN_CONF_SRH_GATHER
+  return srh_attached_len > 0;
+#else
+  return 0;
+#endif /* SDN_CONF_SRH_GATHER */
+}
@@ -74,46 +74,266 @@ LIST(flowtable);
 MEMB(entries_memb, sdn_ft_entry_t, SDN_FT_MAX_ENTRIES);
 MEMB(matches_memb, sdn_ft_match_rule_t, SDN_FT_MAX_MATCHES);
 MEMB(actions_memb, sdn_ft_action_rule_t, SDN_FT_MAX_ACTIONS);
-MEMB(data_memb, uint8_t, SDN_FT_DATA_MEMB_SIZE);
+
+/* Match/action data arena. Blocks are carved off the top of the arena in a
+   few fixed size classes. Freed blocks go on a free list for their class, so
+   allocation and free are O(1) and every block is contiguous. If there's no
+   block of the right class a larger free block is split, and failing that
+   the free lists are rebuilt from the map of free grains, which joins
+   neighbouring blocks back together. */
+#define DATA_GRAIN 8
+#define DATA_GRAINS (SDN_FT_DATA_MEMB_SIZE / DATA_GRAIN)
+static const uint8_t data_class_size[] = SDN_FT_DATA_CLASSES;
+#define DATA_NUM_CLASSES (sizeof(data_class_size) / sizeof(data_class_size[0]))
+static void *data_arena_aligned[SDN_FT_DATA_MEMB_SIZE / sizeof(void *)];
+#define data_arena ((uint8_t *)data_arena_aligned)
+static void *data_free_list[DATA_NUM_CLASSES];
+static uint8_t data_free_map[(DATA_GRAINS + 7) / 8];   /**< grains on a free list */
+static uint16_t data_top = 0;
+static sdn_ft_data_stats_t data_stats;
 
 static uint8_t e_memb_len = 0;
 static uint8_t m_memb_len = 0;
 static uint8_t a_memb_len = 0;
 
+/* Exact-match index. EQ entries are hashed on (index, len, data) so the
+   per-packet lookup cost doesn't grow with the size of the table. Range and
+   NOT_EQ entries are kept on a linear chain in insertion order. */
+typedef struct ft_key {
+  uint8_t index;
+  uint8_t len;
+  uint8_t req_ext;
+  uint8_t refs;                       /**< number of hashed entries with key */
+} ft_key_t;
+
+typedef struct ft_index {
+  ft_key_t        keys[SDN_FT_HASH_MAX_KEYS];
+  sdn_ft_entry_t *buckets[SDN_FT_HASH_SIZE];
+  sdn_ft_entry_t *linear;
+} ft_index_t;
+
+static ft_index_t wl_index;
+static ft_index_t ft_index;
+
+/* Timing wheel. Each slot holds the entries due to expire in one tick (or
+   a multiple of SDN_FT_WHEEL_SLOTS ticks later). A hit only updates
+   last_hit, entries are moved on when their slot comes round. */
+#define WHEEL_NONE 0xFF
+#define wheel_deadline(e) ((e)->last_hit + (e)->lifetime)
+#define wheel_slot(t) (((t) / SDN_FT_WHEEL_TICK) % SDN_FT_WHEEL_SLOTS)
+#define EXPIRED(t, now) ((clock_time_t)((now) - (t)) < ((clock_time_t)~0 >> 1))
+static sdn_ft_entry_t *wheel[SDN_FT_WHEEL_SLOTS];
+static struct ctimer wheel_timer;
+static uint8_t wheel_pos;
+static uint8_t wheel_len;
+
+static sdn_ft_evict_callback_t ft_evict_handler = NULL;
+
+#if SDN_FT_MICROFLOW_SLOTS
+/* Microflow cache. Direct mapped on a hash of the packet's source,
+   destination and next header, and flushed whenever the flowtable changes */
+typedef struct ft_microflow {
+  uint16_t key;
+  uint8_t proto;
+  uint8_t addrs[2 * sizeof(uip_ipaddr_t)];  /**< source then destination */
+  sdn_ft_entry_t *e;
+} ft_microflow_t;
+static ft_microflow_t microflow[SDN_FT_MICROFLOW_SLOTS];
+/* Entries that match on other fields can beat a cached entry, so cached
+   entries are only used if they're above all of those (-1 for none) */
+static int16_t microflow_floor;
+static void microflow_flush(void);
+#else
+#define microflow_flush()
+#endif /* SDN_FT_MICROFLOW_SLOTS */
+
+/* Pools evict() can make room in */
+#define EVICT_ENTRY  0
+#define EVICT_MATCH  1
+#define EVICT_ACTION 2
+#define EVICT_DATA   3
+
 /* Prototypes */
 int sdn_ft_rm_entry(sdn_ft_entry_t *entry);
 static int default_cmp(sdn_ft_entry_t *e);
+static void wheel_rm(sdn_ft_entry_t *e);
+static void wheel_turn(void *ptr);
+static uint8_t evict(uint8_t pool, uint8_t c);
 /*---------------------------------------------------------------------------*/
 /*                            Memory Management                              */
+/*---------------------------------------------------------------------------*/
+static uint8_t
+data_class(uint8_t size)
+{
+  uint8_t c = 0;
+  while(c < DATA_NUM_CLASSES && data_class_size[c] < size) {
+    c++;
+  }
+  return c;
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+data_map_set(uint8_t *map, uint8_t *block, uint8_t size, uint8_t free)
+{
+  uint16_t g = (block - data_arena) / DATA_GRAIN;
+  uint16_t end = g + size / DATA_GRAIN;
+  for(; g < end; g++) {
+    if(free) {
+      map[g / 8] |= 1 << (g % 8);
+    } else {
+      map[g / 8] &= ~(1 << (g % 8));
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+data_push(void *data, uint8_t c)
+{
+  *(void **)data = data_free_list[c];
+  data_free_list[c] = data;
+  data_map_set(data_free_map, data, data_class_size[c], 1);
+  data_stats.free_listed += data_class_size[c];
+}
+
+/*---------------------------------------------------------------------------*/
+static void *
+data_pop(uint8_t c)
+{
+  void *data = data_free_list[c];
+  data_free_list[c] = *(void **)data;
+  data_map_set(data_free_map, data, data_class_size[c], 0);
+  data_stats.free_listed -= data_class_size[c];
+  return data;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Puts a free run of the arena back on the free lists, largest blocks first */
+static void
+data_release(uint8_t *data, uint16_t len)
+{
+  uint8_t c;
+  while(len >= data_class_size[0]) {
+    for(c = DATA_NUM_CLASSES - 1; data_class_size[c] > len; c--);
+    data_push(data, c);
+    data += data_class_size[c];
+    len -= data_class_size[c];
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Takes a block of class c from the front of the smallest larger free block */
+static void *
+data_split(uint8_t c)
+{
+  uint8_t k;
+  uint8_t *data;
+  for(k = c + 1; k < DATA_NUM_CLASSES; k++) {
+    if(data_free_list[k] != NULL) {
+      data = data_pop(k);
+      data_release(data + data_class_size[c],
+                   data_class_size[k] - data_class_size[c]);
+      return data;
+    }
+  }
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Rebuilds the free lists from the free map, so neighbouring free blocks
+   are joined. A free run at the top of the arena is handed back to it. */
+static void
+data_compact(void)
+{
+  uint16_t g, start;
+  uint16_t top = data_top / DATA_GRAIN;
+
+  memset(data_free_list, 0, sizeof(data_free_list));
+  data_stats.free_listed = 0;
+  for(g = 0; g < top;) {
+    if(!(data_free_map[g / 8] & (1 << (g % 8)))) {
+      g++;
+      continue;
+    }
+    for(start = g; g < top && (data_free_map[g / 8] & (1 << (g % 8))); g++);
+    if(g == top) {
+      data_map_set(data_free_map, &data_arena[start * DATA_GRAIN],
+                   (g - start) * DATA_GRAIN, 0);
+      data_top = start * DATA_GRAIN;
+    } else {
+      data_release(&data_arena[start * DATA_GRAIN], (g - start) * DATA_GRAIN);
+    }
+  }
+}
+
 /*---------------------------------------------------------------------------*/
 static void *
 data_alloc(uint8_t size)
 {
-  int i;
-  void *data = NULL;
-  for(i = 0; i < size; i++) {
-    data = memb_alloc(&data_memb);
-    if(data == NULL) {
-      LOG_ERR("FAILED to allocate data!\n");
+  void *data;
+  uint8_t c;
+  uint8_t compacted = 0;
+
+  if(size == 0) {
+    return NULL;
+  }
+  c = data_class(size);
+  if(c == DATA_NUM_CLASSES) {
+    LOG_ERR("FAILED to allocate data! (%d bytes is too large)\n", size);
+    data_stats.failed++;
+    return NULL;
+  }
+  for(;;) {
+    if(data_free_list[c] != NULL) {
+      /* Reuse a freed block of this size */
+      data = data_pop(c);
+      break;
+    } else if(data_top + data_class_size[c] <= sizeof(data_arena_aligned)) {
+      /* Carve a new block off the arena */
+      data = &data_arena[data_top];
+      data_top += data_class_size[c];
+      break;
+    } else if((data = data_split(c)) != NULL) {
+      break;
+    } else if(!compacted) {
+      data_compact();
+      compacted = 1;
+    } else if(evict(EVICT_DATA, c)) {
+      compacted = 0;
+    } else {
+      LOG_ERR("FAILED to allocate data! (%d/%d, %d fragmented)\n",
+              data_stats.used, data_stats.size, data_stats.free_listed);
+      data_stats.failed++;
+      return NULL;
     }
   }
-  /* Need to return -1 on the size otherwise we get a pointer to the element
-     BEFORE the one we actually need. (i.e. we would get 0xaaaa rather than
-     0xaaab) */
-  return (data-(size-1));
+  data_stats.used += data_class_size[c];
+  data_stats.requested += size;
+  LOG_ANNOTATE("#A ftd=%d/%d\n", data_stats.used, data_stats.size);
+  return data;
 }
 
 /*---------------------------------------------------------------------------*/
 static int
 data_free(void *data, uint8_t size) {
-  int i, res = -1;
-  for(i = 0; i < size; i++) {
-    res = memb_free(&data_memb, data + i);
-    if (res != 0) {
-      LOG_ERR("FAILED to free data (%d bytes)! \n", size);
-    }
+  uint8_t c;
+
+  if(data == NULL || size == 0) {
+    return 0;
   }
-  return res;
+  c = data_class(size);
+  if(c == DATA_NUM_CLASSES ||
+     (uint8_t *)data < data_arena || (uint8_t *)data >= &data_arena[data_top]) {
+    LOG_ERR("FAILED to free data (%d bytes)! \n", size);
+    return -1;
+  }
+  /* Put the block on the free list for its class */
+  data_push(data, c);
+  data_stats.used -= data_class_size[c];
+  data_stats.requested -= size;
+  LOG_ANNOTATE("#A ftd=%d/%d\n", data_stats.used, data_stats.size);
+  return 0;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -121,10 +341,11 @@ static sdn_ft_match_rule_t *
 match_allocate()
 {
   sdn_ft_match_rule_t *m;
-  m = memb_alloc(&matches_memb);
+  while((m = memb_alloc(&matches_memb)) == NULL && evict(EVICT_MATCH, 0));
   if(m == NULL) {
     LOG_ERR("FAILED to allocate a match! (%d/%d)\n",
              m_memb_len, SDN_FT_MAX_MATCHES);
+    return NULL;
   }
   m_memb_len++;
   return m;
@@ -135,17 +356,21 @@ static void
 match_free(sdn_ft_match_rule_t *m)
 {
   int res;
-  /* Free any match data */
-  res = data_free(m->data, m->len);
-  if (res != 0){
-    LOG_ERR("FAILED to match data! Reference count: %d\n",res);
-  }
-  /* Free the match */
-  res = memb_free(&matches_memb, m);
-  if (res != 0){
-    LOG_ERR("FAILED to free a match! Reference count: %d\n",res);
-  } else {
-    m_memb_len--;
+  sdn_ft_match_rule_t *next;
+  for(; m != NULL; m = next) {
+    next = m->next;
+    /* Free any match data */
+    res = data_free(m->data, sdn_ft_match_data_len(m));
+    if (res != 0){
+      LOG_ERR("FAILED to match data! Reference count: %d\n",res);
+    }
+    /* Free the match */
+    res = memb_free(&matches_memb, m);
+    if (res != 0){
+      LOG_ERR("FAILED to free a match! Reference count: %d\n",res);
+    } else {
+      m_memb_len--;
+    }
   }
 }
 
@@ -154,7 +379,7 @@ static sdn_ft_action_rule_t *
 action_allocate(void)
 {
   sdn_ft_action_rule_t *a;
-  a = memb_alloc(&actions_memb);
+  while((a = memb_alloc(&actions_memb)) == NULL && evict(EVICT_ACTION, 0));
   if(a == NULL) {
     LOG_ERR("FAILED to allocate an action! (%d/%d)\n",
               a_memb_len, SDN_FT_MAX_ACTIONS);
@@ -170,17 +395,21 @@ static void
 action_free(sdn_ft_action_rule_t *a)
 {
   int res;
-  /* Free any action data */
-  res = data_free(a->data, a->len);
-  if (res != 0){
-    LOG_ERR("FAILED to action data! Reference count: %d\n",res);
-  }
-  /* Free the action */
-  res = memb_free(&actions_memb, a);
-  if (res != 0){
-    LOG_ERR("FAILED to free an action! Reference count: %d\n",res);
-  } else {
-    a_memb_len--;
+  sdn_ft_action_rule_t *next;
+  for(; a != NULL; a = next) {
+    next = a->next;
+    /* Free any action data */
+    res = data_free(a->data, a->len);
+    if (res != 0){
+      LOG_ERR("FAILED to action data! Reference count: %d\n",res);
+    }
+    /* Free the action */
+    res = memb_free(&actions_memb, a);
+    if (res != 0){
+      LOG_ERR("FAILED to free an action! Reference count: %d\n",res);
+    } else {
+      a_memb_len--;
+    }
   }
 }
 
@@ -190,11 +419,9 @@ entry_allocate(void)
 {
   sdn_ft_entry_t *e;
 
-  /* try to allocate */
-  e = memb_alloc(&entries_memb);
+  /* try to allocate, making room if the table is full */
+  while((e = memb_alloc(&entries_memb)) == NULL && evict(EVICT_ENTRY, 0));
   if(e == NULL) {
-    /* table is full!!! */
-    // TODO: What if the table is full?
     LOG_ERR("FAILED to allocate an entry! (%d/%d)\n",
               e_memb_len, SDN_FT_MAX_ENTRIES);
     return NULL;
@@ -205,6 +432,7 @@ entry_allocate(void)
   e->next = NULL;
   e->match_rule = NULL;
   e->action_rule = NULL;
+  e->slot = WHEEL_NONE;
   // LIST_STRUCT_INIT(e, match_list);
   // LIST_STRUCT_INIT(e, action_list);
   // e->stats.ttl = 0;
@@ -217,6 +445,7 @@ static void
 entry_free(sdn_ft_entry_t *e)
 {
   LOG_DBG("Freeing entry (%p)\n", e);
+  wheel_rm(e);
   match_free(e->match_rule);
   action_free(e->action_rule);
   list_remove(flowtable, e);
@@ -224,7 +453,7 @@ entry_free(sdn_ft_entry_t *e)
   if (res !=0){
     LOG_ERR("FAILED to free an entry! Reference count: %d\n",res);
   } else {
-    a_memb_len--;
+    e_memb_len--;
   }
 }
 
@@ -245,6 +474,214 @@ entry_timedout(void *ptr) {
   e = NULL;
 }
 
+#if SDN_FT_EVICT != SDN_FT_EVICT_NONE
+/*---------------------------------------------------------------------------*/
+/* Whether e should be evicted before victim */
+static uint8_t
+evict_before(sdn_ft_entry_t *e, sdn_ft_entry_t *victim)
+{
+#if SDN_FT_EVICT == SDN_FT_EVICT_LFU
+  return e->stats.count < victim->stats.count ||
+         (e->stats.count == victim->stats.count &&
+          EXPIRED(e->last_used, victim->last_used));
+#elif SDN_FT_EVICT == SDN_FT_EVICT_PRIORITY
+  return e->priority < victim->priority ||
+         (e->priority == victim->priority &&
+          EXPIRED(e->last_used, victim->last_used));
+#else /* SDN_FT_EVICT_LRU */
+  return EXPIRED(e->last_used, victim->last_used);
+#endif /* SDN_FT_EVICT */
+}
+
+/*---------------------------------------------------------------------------*/
+/* Marks the data blocks of an entry as free in a copy of the free map (if
+   given). Returns 0 if the entry has no data. */
+static uint8_t
+evict_map_data(uint8_t *map, sdn_ft_entry_t *e)
+{
+  sdn_ft_match_rule_t *m;
+  sdn_ft_action_rule_t *a;
+  uint8_t found = 0;
+  for(m = e->match_rule; m != NULL; m = m->next) {
+    if(m->data != NULL && map != NULL) {
+      data_map_set(map, m->data,
+                   data_class_size[data_class(sdn_ft_match_data_len(m))], 1);
+    }
+    found |= m->data != NULL;
+  }
+  for(a = e->action_rule; a != NULL; a = a->next) {
+    if(a->data != NULL && map != NULL) {
+      data_map_set(map, a->data, data_class_size[data_class(a->len)], 1);
+    }
+    found |= a->data != NULL;
+  }
+  return found;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Whether a map has a free run of at least size bytes, counting the
+   unused top of the arena */
+static uint8_t
+evict_data_fits(uint8_t *map, uint8_t size)
+{
+  uint16_t g, run = 0;
+  uint16_t top = data_top / DATA_GRAIN;
+  for(g = 0; g < top; g++) {
+    if(map[g / 8] & (1 << (g % 8))) {
+      if(++run >= size / DATA_GRAIN) {
+        return 1;
+      }
+    } else {
+      run = 0;
+    }
+  }
+  return run + (sizeof(data_arena_aligned) - data_top) / DATA_GRAIN >=
+         size / DATA_GRAIN;
+}
+#endif /* SDN_FT_EVICT != SDN_FT_EVICT_NONE */
+
+/*---------------------------------------------------------------------------*/
+/* Frees flowtable entries to make room in a pool. Only entries holding
+   memory from that pool are evicted, and for data only if the entries
+   picked free a run big enough for a block of class c. Returns 0, having
+   evicted nothing, if that isn't possible. */
+static uint8_t
+evict(uint8_t pool, uint8_t c)
+{
+#if SDN_FT_EVICT != SDN_FT_EVICT_NONE
+  sdn_ft_entry_t *e;
+  sdn_ft_entry_t *victim;
+  sdn_ft_entry_t *victims[SDN_FT_MAX_ENTRIES];
+  uint8_t map[sizeof(data_free_map)];
+  uint8_t n = 0;
+  uint8_t i;
+
+  memcpy(map, data_free_map, sizeof(map));
+  for(;;) {
+    victim = NULL;
+    for(e = list_head(flowtable); e != NULL; e = e->next) {
+      if(default_cmp(e) ||
+         (pool == EVICT_MATCH && e->match_rule == NULL) ||
+         (pool == EVICT_ACTION && e->action_rule == NULL) ||
+         (pool == EVICT_DATA && !evict_map_data(NULL, e))) {
+        continue;
+      }
+      for(i = 0; i < n && victims[i] != e; i++);
+      if(i == n && (victim == NULL || evict_before(e, victim))) {
+        victim = e;
+      }
+    }
+    if(victim == NULL) {
+      return 0;
+    }
+    victims[n++] = victim;
+    if(pool != EVICT_DATA) {
+      break;
+    }
+    evict_map_data(map, victim);
+    if(evict_data_fits(map, data_class_size[c])) {
+      break;
+    }
+  }
+
+  for(i = 0; i < n; i++) {
+    victim = victims[i];
+    LOG_INFO("EVICT entry %d (hits %u)\n", victim->id, victim->stats.count);
+    if(ft_evict_handler != NULL) {
+      ft_evict_handler(victim);
+    }
+    sdn_ft_rm_entry(victim);
+    entry_free(victim);
+  }
+  return 1;
+#else
+  return 0;
+#endif /* SDN_FT_EVICT != SDN_FT_EVICT_NONE */
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                Timing Wheel                               */
+/*---------------------------------------------------------------------------*/
+static void
+wheel_insert(sdn_ft_entry_t *e, clock_time_t now)
+{
+  clock_time_t deadline = wheel_deadline(e);
+  /* Anything due this tick goes in the next slot */
+  if(deadline / SDN_FT_WHEEL_TICK == now / SDN_FT_WHEEL_TICK ||
+     EXPIRED(deadline, now)) {
+    e->slot = (wheel_slot(now) + 1) % SDN_FT_WHEEL_SLOTS;
+  } else {
+    e->slot = wheel_slot(deadline);
+  }
+  e->wnext = wheel[e->slot];
+  wheel[e->slot] = e;
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+wheel_add(sdn_ft_entry_t *e)
+{
+  clock_time_t now = clock_time();
+  if(wheel_len == 0) {
+    /* Start turning the wheel again */
+    wheel_pos = wheel_slot(now);
+    ctimer_set(&wheel_timer, SDN_FT_WHEEL_TICK, wheel_turn, NULL);
+  }
+  wheel_insert(e, now);
+  wheel_len++;
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+wheel_rm(sdn_ft_entry_t *e)
+{
+  sdn_ft_entry_t **p;
+  if(e->slot == WHEEL_NONE) {
+    return;
+  }
+  for(p = &wheel[e->slot]; *p != NULL; p = &(*p)->wnext) {
+    if(*p == e) {
+      *p = e->wnext;
+      break;
+    }
+  }
+  e->slot = WHEEL_NONE;
+  if(--wheel_len == 0) {
+    ctimer_stop(&wheel_timer);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+wheel_turn(void *ptr)
+{
+  clock_time_t now = clock_time();
+  uint8_t n = SDN_FT_WHEEL_SLOTS;
+  sdn_ft_entry_t *e, *next;
+
+  /* Do every slot up to now, in case we've been held up */
+  while(wheel_pos != wheel_slot(now) && n-- > 0) {
+    wheel_pos = (wheel_pos + 1) % SDN_FT_WHEEL_SLOTS;
+    e = wheel[wheel_pos];
+    wheel[wheel_pos] = NULL;
+    for(; e != NULL; e = next) {
+      next = e->wnext;
+      if(EXPIRED(wheel_deadline(e), now)) {
+        e->slot = WHEEL_NONE;
+        wheel_len--;
+        entry_timedout(e);
+      } else {
+        wheel_insert(e, now);
+      }
+    }
+  }
+  if(wheel_len > 0) {
+    ctimer_reset(&wheel_timer);
+  } else {
+    ctimer_stop(&wheel_timer);
+  }
+}
+
 /*---------------------------------------------------------------------------*/
 // static void
 // purge_flowtable(void)
@@ -266,46 +703,58 @@ entry_timedout(void *ptr) {
 static int
 match_cmp(sdn_ft_match_rule_t *a, sdn_ft_match_rule_t *b)
 {
-  // memcmp returns 0 with equality
-  return a->operator == b->operator &&
-         a->index == b->index &&
-         a->len == b->len &&
-         (memcmp(a->data, b->data, a->len) == 0);
+  for(; a != NULL && b != NULL; a = a->next, b = b->next) {
+    // memcmp returns 0 with equality
+    if(a->operator != b->operator ||
+       a->index != b->index ||
+       a->len != b->len ||
+       memcmp(a->data, b->data, sdn_ft_match_data_len(a)) != 0) {
+      return 0;
+    }
+  }
+  /* Both chains have to end together */
+  return a == b;
 }
 
 /*---------------------------------------------------------------------------*/
 static int
 action_cmp(sdn_ft_action_rule_t *a, sdn_ft_action_rule_t *b)
 {
-  // memcmp returns 0 with equality
-  return a->action == b->action &&
-         a->index == b->index &&
-         a->len == b->len &&
-         (memcmp(a->data, b->data, a->len) == 0);
+  for(; a != NULL && b != NULL; a = a->next, b = b->next) {
+    // memcmp returns 0 with equality
+    if(a->action != b->action ||
+       a->index != b->index ||
+       a->len != b->len ||
+       memcmp(a->data, b->data, a->len) != 0) {
+      return 0;
+    }
+  }
+  return a == b;
 }
 
 /*---------------------------------------------------------------------------*/
 static int
 default_cmp(sdn_ft_entry_t *e)
 {
-  return match_cmp(e->match_rule, default_match) && action_cmp(e->action_rule, default_action);
+  return default_match != NULL && default_action != NULL &&
+         match_cmp(e->match_rule, default_match) &&
+         action_cmp(e->action_rule, default_action);
 }
 
 /*---------------------------------------------------------------------------*/
 static int
 entry_cmp(sdn_ft_entry_t* a, sdn_ft_entry_t* b)
 {
-  //TODO need to do this for lists of matches and actions
   return match_cmp(a->match_rule, b->match_rule) && action_cmp(a->action_rule, b->action_rule);
 }
 
 /*---------------------------------------------------------------------------*/
-static int
-entry_exists(sdn_ft_entry_t *e) {
+int
+sdn_ft_entry_exists(sdn_ft_match_rule_t *match, sdn_ft_action_rule_t *action) {
   /* Check to see if this entry is already in the table */
   sdn_ft_entry_t *tmp = list_head(flowtable);
   while(tmp != NULL) {
-    if (entry_cmp(tmp, e)){
+    if(match_cmp(tmp->match_rule, match) && action_cmp(tmp->action_rule, action)) {
       return 1;
     }
     tmp = tmp->next;
@@ -314,44 +763,224 @@ entry_exists(sdn_ft_entry_t *e) {
 }
 
 /*---------------------------------------------------------------------------*/
-/*                           Flowtable Functions                             */
+/*                            Exact-Match Index                              */
 /*---------------------------------------------------------------------------*/
-/* Perform match on the data with the entry in the ft. Return
- * 1 if successful, 0 if not.
- */
-int
-sdn_ft_do_match(sdn_ft_match_rule_t *match_rule, uint8_t *data, uint8_t ext_len)
+static uint16_t
+hash_bytes(uint8_t index, uint8_t len, const uint8_t *data)
 {
-  int ext = 0;
-  /* If we are matching on anything above the IP header we need the ext_len */
-  if(match_rule->req_ext) {
-    ext = ext_len;
+  uint8_t i;
+  uint16_t h = index ^ ((uint16_t)len << 8);
+  for(i = 0; i < len; i++) {
+    h = (h << 5) + h + data[i];
+  }
+  return (h ^ (h >> 8)) & (SDN_FT_HASH_SIZE - 1);
+}
+
+/*---------------------------------------------------------------------------*/
+static ft_index_t *
+get_index(flowtable_id_t id)
+{
+  switch(id) {
+    case WHITELIST: return &wl_index;
+    case FLOWTABLE: return &ft_index;
+    default: return NULL;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Find the hashed key for a match. If add is set and the key isn't in use
+   yet then a free key slot is claimed for it. */
+static ft_key_t *
+index_get_key(ft_index_t *idx, sdn_ft_match_rule_t *m, uint8_t add)
+{
+  int i;
+  ft_key_t *k, *free_key = NULL;
+  for(i = 0; i < SDN_FT_HASH_MAX_KEYS; i++) {
+    k = &idx->keys[i];
+    if(k->refs == 0) {
+      if(free_key == NULL) {
+        free_key = k;
+      }
+    } else if(k->index == m->index && k->len == m->len &&
+              k->req_ext == m->req_ext) {
+      return k;
+    }
+  }
+  if(add && free_key != NULL) {
+    free_key->index = m->index;
+    free_key->len = m->len;
+    free_key->req_ext = m->req_ext;
+    return free_key;
+  }
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static uint8_t
+chain_unlink(sdn_ft_entry_t **chain, sdn_ft_entry_t *e)
+{
+  while(*chain != NULL) {
+    if(*chain == e) {
+      *chain = e->inext;
+      e->inext = NULL;
+      return 1;
+    }
+    chain = &(*chain)->inext;
+  }
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+index_add(ft_index_t *idx, sdn_ft_entry_t *e)
+{
+  ft_key_t *k;
+  sdn_ft_entry_t **chain;
+  sdn_ft_match_rule_t *m = e->match_rule;
+
+  e->inext = NULL;
+  if(m->operator == EQ && (k = index_get_key(idx, m, 1)) != NULL) {
+    k->refs++;
+    chain = &idx->buckets[hash_bytes(m->index, m->len, m->data)];
+  } else {
+    /* Out of keys, or not an exact match */
+    chain = &idx->linear;
+  }
+  /* Chains are kept in priority order. Go in after entries with the same
+     priority, so older entries are still hit first */
+  while(*chain != NULL && (*chain)->priority >= e->priority) {
+    chain = &(*chain)->inext;
+  }
+  e->inext = *chain;
+  *chain = e;
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+index_rm(ft_index_t *idx, sdn_ft_entry_t *e)
+{
+  ft_key_t *k;
+  sdn_ft_match_rule_t *m = e->match_rule;
+
+  if(m->operator == EQ && (k = index_get_key(idx, m, 0)) != NULL) {
+    if(chain_unlink(&idx->buckets[hash_bytes(m->index, m->len, m->data)], e)) {
+      k->refs--;
+      return;
+    }
   }
-  /* Compare the packet bytes with the match bytes at the index specified
-     by the match_rule (+ possible extension length) */
-  int cmp_result = memcmp(match_rule->data,
-                          data + (match_rule->index) + ext,
-                          match_rule->len);
+  chain_unlink(&idx->linear, e);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                           Flowtable Functions                             */
+/*---------------------------------------------------------------------------*/
+/* Compare routines. sdn_ft_create_match() picks one for each match */
+#define MATCH_GENERIC   0     /* memcmp, then the operator */
+#define MATCH_MASK      1
+#define MATCH_EQ_BYTE   2     /* 1 byte EQ (next header, ICMP type) */
+#define MATCH_CMP_BYTE  3     /* 1 byte, any other operator */
+#define MATCH_CMP_WORD  4     /* 2 byte big endian field (ports) */
+#define MATCH_EQ_ADDR   5     /* 16 byte EQ/NOT_EQ (IPv6 addresses) */
+
+#define CMP(a, b) (((a) > (b)) - ((a) < (b)))
 
-  /* memcmp only returns <0, 0 or >0, so we need to do checks based on the
-     match operator */
-  switch(match_rule->operator) {
+static uint8_t
+match_select(sdn_ft_match_rule_t *m)
+{
+  if(m->operator == MASK) {
+    return MATCH_MASK;
+  }
+#if SDN_FT_SPECIALISE_MATCH
+  switch(m->len) {
+    case 1:
+      return m->operator == EQ ? MATCH_EQ_BYTE : MATCH_CMP_BYTE;
+    case 2:
+      return MATCH_CMP_WORD;
+    case sizeof(uip_ipaddr_t):
+      if(m->operator == EQ || m->operator == NOT_EQ) {
+        return MATCH_EQ_ADDR;
+      }
+      break;
+  }
+#endif /* SDN_FT_SPECIALISE_MATCH */
+  return MATCH_GENERIC;
+}
+/*---------------------------------------------------------------------------*/
+/* cmp is the match data compared to the packet field, as memcmp() returns */
+static int
+op_result(sdn_ft_match_op_t operator, int cmp)
+{
+  switch(operator) {
     case EQ:
-      return (cmp_result == 0);
+      return (cmp == 0);
     case LT_EQ:
-      return (cmp_result <= 0);
+      return (cmp <= 0);
     case GT_EQ:
-      return (cmp_result >= 0);
+      return (cmp >= 0);
     case NOT_EQ:
-      return (cmp_result != 0);
+      return (cmp != 0);
     case LT:
-      return (cmp_result < 0);
+      return (cmp < 0);
     case GT:
-      return (cmp_result > 0);
+      return (cmp > 0);
     default:
       return -1; //should never get here
   }
 }
+/*---------------------------------------------------------------------------*/
+static uint8_t
+addr_eq(const uint8_t *a, const uint8_t *b)
+{
+  const uint16_t *x = (const uint16_t *)a;
+  const uint16_t *y = (const uint16_t *)b;
+  /* Match data is word aligned, the packet field should be too */
+  if(((uintptr_t)b & 1) != 0) {
+    return memcmp(a, b, sizeof(uip_ipaddr_t)) == 0;
+  }
+  /* The interface id is the most likely to differ, so start with that */
+  return x[7] == y[7] && x[6] == y[6] && x[5] == y[5] && x[4] == y[4] &&
+         x[3] == y[3] && x[2] == y[2] && x[1] == y[1] && x[0] == y[0];
+}
+/*---------------------------------------------------------------------------*/
+/* Perform match on the data with the entry in the ft. Return
+ * 1 if successful, 0 if not.
+ */
+int
+sdn_ft_do_match(sdn_ft_match_rule_t *match_rule, uint8_t *data, uint8_t ext_len)
+{
+  uint8_t i;
+  uint8_t *value = match_rule->data;
+  uint8_t *field = data + match_rule->index;
+  /* If we are matching on anything above the IP header we need the ext_len */
+  if(match_rule->req_ext) {
+    field += ext_len;
+  }
+  switch(match_rule->matcher) {
+    case MATCH_EQ_BYTE:
+      return *field == *value;
+    case MATCH_CMP_BYTE:
+      return op_result(match_rule->operator, CMP(value[0], field[0]));
+    case MATCH_CMP_WORD:
+      return op_result(match_rule->operator,
+                       CMP((uint16_t)(value[0] << 8 | value[1]),
+                           (uint16_t)(field[0] << 8 | field[1])));
+    case MATCH_EQ_ADDR:
+      return addr_eq(value, field) == (match_rule->operator == EQ);
+    case MATCH_MASK:
+      /* The value is pre-masked, so only the packet needs masking */
+      for(i = 0; i < match_rule->len; i++) {
+        if((field[i] & value[match_rule->len + i]) != value[i]) {
+          return 0;
+        }
+      }
+      return 1;
+    default:
+      /* Compare the packet bytes with the match bytes at the index specified
+         by the match_rule (+ possible extension length) */
+      return op_result(match_rule->operator,
+                       memcmp(value, field, match_rule->len));
+  }
+}
 
 /*---------------------------------------------------------------------------*/
 uint8_t
@@ -371,38 +1000,191 @@ sdn_ft_contains(void *data, uint8_t len)
   return 0;
 }
 
+/*---------------------------------------------------------------------------*/
+/* Check all of an entry's matches against the datagram */
+static int
+match_all(sdn_ft_match_rule_t *m, uint8_t *data, uint16_t len, uint8_t ext_len)
+{
+  for(; m != NULL; m = m->next) {
+    /* See if we can actually do the check, given the datagram */
+    if(len < (m->index + m->len) || !sdn_ft_do_match(m, data, ext_len)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Find the highest priority entry matching the datagram. Hashed EQ entries
+   are probed once per key, then the linear chain is searched. Chains are in
+   priority order, so each search stops once it can't do any better.
+ */
+static sdn_ft_entry_t *
+index_lookup(ft_index_t *idx, uint8_t *data, uint16_t len, uint8_t ext_len)
+{
+  int i;
+  uint8_t *field;
+  ft_key_t *k;
+  sdn_ft_entry_t *e;
+  sdn_ft_entry_t *best = NULL;
+  sdn_ft_match_rule_t *m;
+
+  for(i = 0; i < SDN_FT_HASH_MAX_KEYS; i++) {
+    k = &idx->keys[i];
+    /* See if we can actually do the check, given the datagram */
+    if(k->refs == 0 || len < (k->index + k->len)) {
+      continue;
+    }
+    field = data + k->index + (k->req_ext ? ext_len : 0);
+    e = idx->buckets[hash_bytes(k->index, k->len, field)];
+    for(; e != NULL && (best == NULL || e->priority > best->priority);
+        e = e->inext) {
+      m = e->match_rule;
+      if(m->index == k->index && m->len == k->len && m->req_ext == k->req_ext &&
+         memcmp(m->data, field, m->len) == 0 &&
+         match_all(m->next, data, len, ext_len)) {
+        best = e;
+        break;
+      }
+    }
+  }
+
+  for(e = idx->linear; e != NULL && (best == NULL || e->priority > best->priority);
+      e = e->inext) {
+    if(match_all(e->match_rule, data, len, ext_len)) {
+      return e;
+    }
+  }
+  return best;
+}
+
+/*---------------------------------------------------------------------------*/
+#if SDN_FT_MICROFLOW_SLOTS
+/* Does the entry only match on fields in the microflow key? */
+static uint8_t
+microflow_keyed(sdn_ft_entry_t *e)
+{
+  sdn_ft_match_rule_t *m;
+  for(m = e->match_rule; m != NULL; m = m->next) {
+    if(m->req_ext ||
+       !((m->index == uip_proto_index && m->len == 1) ||
+         (m->index >= uip_src_index &&
+          m->index + m->len <= uip_src_index + 2 * sizeof(uip_ipaddr_t)))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+microflow_flush(void)
+{
+  sdn_ft_entry_t *e;
+  memset(microflow, 0, sizeof(microflow));
+  microflow_floor = -1;
+  for(e = list_head(flowtable); e != NULL; e = e->next) {
+    if(e->priority > microflow_floor && !microflow_keyed(e)) {
+      microflow_floor = e->priority;
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static sdn_ft_entry_t *
+microflow_lookup(ft_index_t *idx, uint8_t *data, uint16_t len, uint8_t ext_len)
+{
+  uint8_t i;
+  uint16_t key;
+  ft_microflow_t *mf;
+  sdn_ft_entry_t *e;
+
+  if(len < uip_dst_index + sizeof(uip_ipaddr_t)) {
+    return index_lookup(idx, data, len, ext_len);
+  }
+  /* Source and destination addresses are next to each other */
+  key = data[uip_proto_index];
+  for(i = 0; i < 2 * sizeof(uip_ipaddr_t); i++) {
+    key = (key << 5) + key + data[uip_src_index + i];
+  }
+  mf = &microflow[key % SDN_FT_MICROFLOW_SLOTS];
+
+  /* Only the same flow gets the cached entry. Another flow in this slot
+     could have a more specific entry of higher priority */
+  e = mf->e;
+  if(e != NULL && mf->key == key && mf->proto == data[uip_proto_index] &&
+     memcmp(mf->addrs, &data[uip_src_index], sizeof(mf->addrs)) == 0) {
+    return e;
+  }
+  e = index_lookup(idx, data, len, ext_len);
+  if(e != NULL && e->priority > microflow_floor) {
+    mf->key = key;
+    mf->proto = data[uip_proto_index];
+    memcpy(mf->addrs, &data[uip_src_index], sizeof(mf->addrs));
+    mf->e = e;
+  }
+  return e;
+}
+#endif /* SDN_FT_MICROFLOW_SLOTS */
+
 /*---------------------------------------------------------------------------*/
 /* Perform a check against the flowtable lists
  */
-int
-sdn_ft_check_list(list_t list, void *data, uint16_t len, uint8_t ext_len)
+static sdn_ft_entry_t *
+lookup_table(list_t list, ft_index_t *idx, void *data, uint16_t len, uint8_t ext_len)
 {
-  /* Search the FT entries for a match with the packet */
-  sdn_ft_entry_t *e = list_head(list);
-  if(e == NULL) {
+  sdn_ft_entry_t *e;
+
+  if(list_head(list) == NULL) {
     LOG_WARN("FLOWTABLE empty\n");
-    return SDN_NO_MATCH;
+    return NULL;
   }
-  while(e != NULL) {
-    /* See if we can actually do the check, given the datagram */
-    if(len >= (e->match_rule->index + e->match_rule->len)) {
-       /* See if we have a successful match */
-      if (sdn_ft_do_match(e->match_rule, data, ext_len)) {
+  /* Search the FT entries for a match with the packet */
+#if SDN_FT_MICROFLOW_SLOTS
+  e = list == flowtable ? microflow_lookup(idx, data, len, ext_len)
+                        : index_lookup(idx, data, len, ext_len);
+#else
+  e = index_lookup(idx, data, len, ext_len);
+#endif /* SDN_FT_MICROFLOW_SLOTS */
+  if(e != NULL) {
+    if(e->stats.count < 0xFFFF) {
+      e->stats.count++;
+    }
+    e->last_used = clock_time();
 #if SDN_CONF_REFRESH_LIFETIME_ON_HIT
-        /* If REFRESH_HITS is on, then we need to reset the lifetimer */
-        LOG_DBG("RESET entry timer!\n");
-        ctimer_restart(&e->lifetimer);
-#endif
-        /* If the entry matches the datagram, we perform the associated
-           action. We then return the results of that action */
-        // TODO: What if we have multiple actions?
-        LOG_DBG("Match found!\n");
-        print_sdn_ft_entry(e);
-        LOG_DBG("Returning action!\n");
-        return ft_action_handler(e->action_rule, data);
-      }
+    /* If REFRESH_HITS is on, the entry lives on from this hit */
+    if(!e->hard) {
+      e->last_hit = clock_time();
     }
-    e = e->next;
+#endif
+    LOG_DBG("Match found!\n");
+    print_sdn_ft_entry(e);
+  }
+  return e;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Perform an entry's actions in turn, for as long as they accept the packet */
+static int
+do_actions(sdn_ft_action_rule_t *a, void *data)
+{
+  int result;
+  while((result = ft_action_handler(a, data)) == UIP_ACCEPT && a->next != NULL) {
+    a = a->next;
+  }
+  return result;
+}
+
+/*---------------------------------------------------------------------------*/
+static int
+check_table(list_t list, ft_index_t *idx, void *data, uint16_t len, uint8_t ext_len)
+{
+  sdn_ft_entry_t *e = lookup_table(list, idx, data, len, ext_len);
+  if(e != NULL) {
+    /* If the entry matches the datagram, we perform the associated
+       action. We then return the results of that action */
+    LOG_DBG("Returning action!\n");
+    return do_actions(e->action_rule, data);
   }
 
   LOG_DBG("No matches in flowtable! Return NO_MATCH\n");
@@ -427,14 +1209,11 @@ uint8_t
 sdn_ft_check_default(void *data, uint8_t length, uint8_t ext_len)
 {
   if(default_match != NULL && default_action != NULL) {
-    /* See if we can actually do the check, given the datagram */
-    if(length >= (default_match->index + default_match->len)) {
-       /* See if we have a successful match */
-      if (sdn_ft_do_match(default_match, data, ext_len)) {
-        /* If the match is a hit, we do a fast copy into the datagram */
-        LOG_DBG("Default match! Do fast copy...\n");
-        return ft_action_handler(default_action, data);
-      }
+    /* See if we have a successful match */
+    if(match_all(default_match, data, length, ext_len)) {
+      /* If the match is a hit, we do a fast copy into the datagram */
+      LOG_DBG("Default match! Do fast copy...\n");
+      return do_actions(default_action, data);
     }
   }
   LOG_WARN("Default not set\n");
@@ -453,7 +1232,16 @@ sdn_ft_init()
   memb_init(&entries_memb);
   memb_init(&matches_memb);
   memb_init(&actions_memb);
-  memb_init(&data_memb);
+  memset(data_free_list, 0, sizeof(data_free_list));
+  memset(data_free_map, 0, sizeof(data_free_map));
+  data_top = 0;
+  memset(&data_stats, 0, sizeof(data_stats));
+  data_stats.size = sizeof(data_arena_aligned);
+  memset(&wl_index, 0, sizeof(wl_index));
+  memset(&ft_index, 0, sizeof(ft_index));
+  memset(wheel, 0, sizeof(wheel));
+  wheel_len = 0;
+  microflow_flush();
   LOG_INFO("FT initialised");
 }
 
@@ -471,9 +1259,11 @@ sdn_ft_add_entry(flowtable_id_t id, sdn_ft_entry_t *entry)
     default: return 0;
   }
 
-  if(!entry_exists(entry)){
+  if(!sdn_ft_entry_exists(entry->match_rule, entry->action_rule)){
     /* It wasn't found, so add it */
     list_add(list, entry);
+    index_add(get_index(id), entry);
+    microflow_flush();
     print_sdn_ft_entry(entry);
     LOG_ANNOTATE("#A %s=%d/%d\n", ((id == FLOWTABLE) ? "ft" : "wl"),
                               list_length(list), SDN_FT_MAX_ENTRIES);
@@ -489,11 +1279,13 @@ int
 sdn_ft_rm_entry(sdn_ft_entry_t *entry)
 {
   sdn_ft_entry_t* tmp;
+  microflow_flush();
   /* Whitelist */
   for(tmp = list_head(whitelist); tmp != NULL; tmp = tmp->next) {
     if (entry_cmp(entry, tmp)){
       /* Remove entry from the whitelist */
       list_remove(whitelist, entry);
+      index_rm(&wl_index, entry);
       LOG_DBG("WHITELIST Removed entry (%p) from list\n", entry);
       LOG_ANNOTATE("#A wl=%d/%d\n", list_length(whitelist), SDN_FT_MAX_ENTRIES);
     }
@@ -503,6 +1295,7 @@ sdn_ft_rm_entry(sdn_ft_entry_t *entry)
     if (entry_cmp(entry, tmp)){
       /* Remove entry from the flowtable */
       list_remove(flowtable, entry);
+      index_rm(&ft_index, entry);
       LOG_DBG("FLOWTBLE Removed entry (%p) from list\n", entry);
       LOG_ANNOTATE("#A ft=%d/%d\n", list_length(flowtable), SDN_FT_MAX_ENTRIES);
     }
@@ -518,18 +1311,50 @@ sdn_ft_create_entry(flowtable_id_t id,
                     sdn_ft_action_rule_t *action,
                     clock_time_t lifetime,
                     uint8_t is_default)
+{
+  return sdn_ft_create_entry_priority(id, match, action, lifetime, is_default,
+                                      SDN_FT_PRIORITY_DEFAULT);
+}
+
+/*---------------------------------------------------------------------------*/
+sdn_ft_entry_t *
+sdn_ft_create_entry_priority(flowtable_id_t id,
+                             sdn_ft_match_rule_t *match,
+                             sdn_ft_action_rule_t *action,
+                             clock_time_t lifetime,
+                             uint8_t is_default,
+                             uint8_t priority)
 {
   LOG_DBG("Creating entry\n");
+  if(match == NULL || action == NULL) {
+    LOG_ERR("Cannot create an entry without a match and an action!\n");
+    if(match != NULL) {
+      match_free(match);
+    }
+    if(action != NULL) {
+      action_free(action);
+    }
+    return NULL;
+  }
+  /* Check before allocating, so a duplicate doesn't evict anything */
+  if(sdn_ft_entry_exists(match, action)) {
+    LOG_DBG("Entry already exists, not adding it\n");
+    match_free(match);
+    action_free(action);
+    return NULL;
+  }
   sdn_ft_entry_t *e = entry_allocate();
   if(e != NULL) {
     e->id = generate_id();
+    e->priority = priority;
+    e->last_hit = clock_time();
+    e->last_used = e->last_hit;
     e->match_rule = match;
     e->action_rule = action;
     if(sdn_ft_add_entry(id, e)) {
-      if (lifetime == SDN_FT_INFINITE_LIFETIME) {
-        ctimer_stop(&e->lifetimer);
-      } else {
-        ctimer_set(&e->lifetimer, lifetime, entry_timedout, e);
+      if (lifetime != SDN_FT_INFINITE_LIFETIME) {
+        e->lifetime = lifetime;
+        wheel_add(e);
       }
       /* Check if we are to set this entry as default */
       if(is_default) {
@@ -538,8 +1363,13 @@ sdn_ft_create_entry(flowtable_id_t id,
       /* Return a pointer to this entry */
       return e;
     }
+    /* Couldn't add it, entry_free() releases the match and action */
+    entry_free(e);
+    return NULL;
   }
-  /* Either we couldn't allocate e, or we couldn't add it to the FT */
+  /* We couldn't allocate e */
+  match_free(match);
+  action_free(action);
   return NULL;
 }
 /*---------------------------------------------------------------------------*/
@@ -556,10 +1386,24 @@ sdn_ft_create_match(sdn_ft_match_op_t operator,
     m->index = index;
     m->len = len;
     m->req_ext = req_ext;
+    m->matcher = match_select(m);
+    m->next = NULL;
     /* Allocate ourselves a bunch of bytes for our data */
-    m->data = data_alloc(len);
+    m->data = data_alloc(sdn_ft_match_data_len(m));
+    if(len > 0 && m->data == NULL) {
+      m->len = 0;
+      match_free(m);
+      return NULL;
+    }
     /* Copy our data over to our flowtable match */
-    memcpy(m->data, data, len);
+    memcpy(m->data, data, sdn_ft_match_data_len(m));
+    if(operator == MASK) {
+      /* Only compare the bits we're masking */
+      uint8_t i;
+      for(i = 0; i < len; i++) {
+        ((uint8_t *)m->data)[i] &= ((uint8_t *)m->data)[len + i];
+      }
+    }
     return m;
   }
   /* We couldn't allocate m */
@@ -574,20 +1418,101 @@ sdn_ft_create_action(sdn_ft_action_type_t action,
                                   void    *data)
 {
   sdn_ft_action_rule_t *a = action_allocate();
+#if SDN_CONF_SRH_PRECOMPILE
+  sdn_srh_route_t route;
+  uint8_t srh[SDN_SRH_COMPILED_MAX];
+  uint8_t srh_len = 0;
+  /* Compile the SRH now and keep it after the route */
+  if(action == SDN_FT_ACTION_SRH && data != NULL && len <= sizeof(route)) {
+    memcpy(&route, data, len);
+    srh_len = sdn_ext_compile_srh(&route, srh);
+  }
+#endif /* SDN_CONF_SRH_PRECOMPILE */
   if(a != NULL) {
     a->action = action;
     a->index = index;
     a->len = len;
+#if SDN_CONF_SRH_PRECOMPILE
+    a->len += srh_len;
+#endif /* SDN_CONF_SRH_PRECOMPILE */
     /* Allocate ourselves a bunch of bytes for our data */
-    a->data = data_alloc(len);
+    a->data = data_alloc(a->len);
+    if(a->len > 0 && a->data == NULL) {
+      a->len = 0;
+      action_free(a);
+      return NULL;
+    }
     /* Copy our data over to our flowtable action */
     memcpy(a->data, data, len);
+#if SDN_CONF_SRH_PRECOMPILE
+    memcpy((uint8_t *)a->data + len, srh, srh_len);
+#endif /* SDN_CONF_SRH_PRECOMPILE */
     return a;
   }
   /* We couldn't allocate a */
   return NULL;
 }
 
+/*---------------------------------------------------------------------------*/
+sdn_ft_match_rule_t *
+sdn_ft_chain_match(sdn_ft_match_rule_t *m, sdn_ft_match_rule_t *next)
+{
+  sdn_ft_match_rule_t *last;
+  if(m == NULL || next == NULL) {
+    match_free(m);
+    match_free(next);
+    return NULL;
+  }
+  for(last = m; last->next != NULL; last = last->next);
+  last->next = next;
+  return m;
+}
+
+/*---------------------------------------------------------------------------*/
+sdn_ft_action_rule_t *
+sdn_ft_chain_action(sdn_ft_action_rule_t *a, sdn_ft_action_rule_t *next)
+{
+  sdn_ft_action_rule_t *last;
+  if(a == NULL || next == NULL) {
+    action_free(a);
+    action_free(next);
+    return NULL;
+  }
+  for(last = a; last->next != NULL; last = last->next);
+  last->next = next;
+  return a;
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+forget_hint(list_t list, void *hint)
+{
+  sdn_ft_entry_t *e;
+  sdn_ft_action_rule_t *a;
+  for(e = list_head(list); e != NULL; e = e->next) {
+    for(a = e->action_rule; a != NULL; a = a->next) {
+      if(a->hint == hint) {
+        a->hint = NULL;
+      }
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+void
+sdn_ft_forget_hint(void *hint)
+{
+  forget_hint(whitelist, hint);
+  forget_hint(flowtable, hint);
+}
+
+/*---------------------------------------------------------------------------*/
+void
+sdn_ft_register_evict_handler(sdn_ft_evict_callback_t callback)
+{
+  ft_evict_handler = callback;
+}
+
 /*---------------------------------------------------------------------------*/
 void
 sdn_ft_register_action_handler(sdn_ft_action_handler_callback_t callback)
@@ -616,7 +1541,44 @@ sdn_ft_check(flowtable_id_t id, void *data, uint16_t len, uint8_t ext_len)
       return -1;
   }
   LOG_DBG("Checking %s\n", (id == WHITELIST) ? "wl" : "ft");
-  return sdn_ft_check_list(list, data, len, ext_len);
+  return check_table(list, get_index(id), data, len, ext_len);
+}
+
+/*---------------------------------------------------------------------------*/
+uint8_t
+sdn_ft_entry_match(sdn_ft_entry_t *e, void *data, uint16_t len, uint8_t ext_len)
+{
+  return match_all(e->match_rule, data, len, ext_len);
+}
+
+/*---------------------------------------------------------------------------*/
+int
+sdn_ft_entry_do_actions(sdn_ft_entry_t *e, void *data)
+{
+  return do_actions(e->action_rule, data);
+}
+
+/*---------------------------------------------------------------------------*/
+/* As sdn_ft_check, but returns the matching entry rather than performing
+   its action */
+sdn_ft_entry_t *
+sdn_ft_lookup(flowtable_id_t id, void *data, uint16_t len, uint8_t ext_len)
+{
+  switch(id) {
+    case WHITELIST:
+      return lookup_table(whitelist, &wl_index, data, len, ext_len);
+    case FLOWTABLE:
+      return lookup_table(flowtable, &ft_index, data, len, ext_len);
+    default:
+      return NULL;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+void
+sdn_ft_get_data_stats(sdn_ft_data_stats_t *stats)
+{
+  memcpy(stats, &data_stats, sizeof(sdn_ft_data_stats_t));
 }
 
 /*---------------------------------------------------------------------------*/
@@ -635,11 +1597,12 @@ print_sdn_ft_match(sdn_ft_match_rule_t *m)
       case LT: printf("LT "); break;
       case GT_EQ: printf("GT_OR_EQ "); break;
       case LT_EQ: printf("LT_OR_EQ "); break;
+      case MASK: printf("MASK "); break;
       default: printf("UNKNOWN "); break;
     }
     printf("INDEX:%d LEN:%d VAL:[", m->index, m->len);
     if(m->data != NULL) {
-      for(i = 0; i < m->len; i++) {
+      for(i = 0; i < sdn_ft_match_data_len(m); i++) {
         printf("%x ", ((uint8_t *)m->data)[i]);
       }
     } else {
@@ -683,11 +1646,16 @@ void
 print_sdn_ft_entry(sdn_ft_entry_t *e)
 {
 // #if LOG_LEVEL == LOG_LEVEL_DBG
-  LOG_DBG("ENTRY: (%p) id:%d ttl: %ld...\n", e, e->id, timer_remaining(&e->lifetimer.etimer.timer));
-  sdn_ft_match_rule_t *m = e->match_rule;
-  sdn_ft_action_rule_t *a = e->action_rule;
-  print_sdn_ft_match(m);
-  print_sdn_ft_action(a);
+  LOG_DBG("ENTRY: (%p) id:%d prio:%d ttl: %ld...\n", e, e->id, e->priority,
+          e->slot == WHEEL_NONE ? -1 : (long)(wheel_deadline(e) - clock_time()));
+  sdn_ft_match_rule_t *m;
+  sdn_ft_action_rule_t *a;
+  for(m = e->match_rule; m != NULL; m = m->next) {
+    print_sdn_ft_match(m);
+  }
+  for(a = e->action_rule; a != NULL; a = a->next) {
+    print_sdn_ft_action(a);
+  }
 // #endif
 }
 
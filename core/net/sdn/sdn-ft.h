@@ -40,8 +40,6 @@
 #ifndef SDN_FT_H_
 #define SDN_FT_H_
 
-//TODO: Need to introduce the concept of priority into the flow table
-
 #include "lib/list.h"
 #include "net/ip/uip.h"
 
@@ -70,9 +68,84 @@
 #else
 #define SDN_FT_DATA_MEMB_SIZE 1024
 #endif
+/* Block sizes (bytes) the match/action data arena is carved into. Must be in
+   ascending order, start at 8 and be multiples of 8. The largest should
+   leave room above the biggest action (a full SRH and its header is 48) */
+#ifdef SDN_CONF_FT_DATA_CLASSES
+#define SDN_FT_DATA_CLASSES   SDN_CONF_FT_DATA_CLASSES
+#else
+#define SDN_FT_DATA_CLASSES   { 8, 16, 24, 32, 48, 64 }
+#endif
+/* Number of buckets in the exact-match (EQ) index. Must be a power of 2 */
+#ifdef SDN_CONF_FT_HASH_SIZE
+#define SDN_FT_HASH_SIZE      SDN_CONF_FT_HASH_SIZE
+#else
+#define SDN_FT_HASH_SIZE      16
+#endif
+/* Number of distinct (index, len) EQ keys that can be hashed per table. EQ
+   entries with any other key fall back to the linear list */
+#ifdef SDN_CONF_FT_HASH_MAX_KEYS
+#define SDN_FT_HASH_MAX_KEYS  SDN_CONF_FT_HASH_MAX_KEYS
+#else
+#define SDN_FT_HASH_MAX_KEYS  4
+#endif
+
+/* Entry lifetimes are kept on a timing wheel, which is turned every tick.
+   Entries expire up to a tick late */
+#ifdef SDN_CONF_FT_WHEEL_SLOTS
+#define SDN_FT_WHEEL_SLOTS    SDN_CONF_FT_WHEEL_SLOTS
+#else
+#define SDN_FT_WHEEL_SLOTS    16
+#endif
+#ifdef SDN_CONF_FT_WHEEL_TICK
+#define SDN_FT_WHEEL_TICK     SDN_CONF_FT_WHEEL_TICK
+#else
+#define SDN_FT_WHEEL_TICK     CLOCK_SECOND
+#endif
 
 #define SDN_FT_INFINITE_LIFETIME 0xFFFF
 
+/* Give common matches (1 and 2 byte fields, IPv6 addresses) their own
+   compare routine rather than a memcmp and a switch on the operator */
+#ifdef SDN_CONF_FT_SPECIALISE_MATCH
+#define SDN_FT_SPECIALISE_MATCH SDN_CONF_FT_SPECIALISE_MATCH
+#else
+#define SDN_FT_SPECIALISE_MATCH 1
+#endif
+
+/* Slots in the microflow cache, which remembers the flowtable entry last
+   matched by packets with the same source, destination and next header. 0 to
+   turn it off */
+#ifdef SDN_CONF_FT_MICROFLOW_SLOTS
+#define SDN_FT_MICROFLOW_SLOTS SDN_CONF_FT_MICROFLOW_SLOTS
+#else
+#define SDN_FT_MICROFLOW_SLOTS 4
+#endif
+
+/* Which flowtable entry to evict when there's no room for a new one.
+   Whitelist entries and the default entry are never evicted */
+#define SDN_FT_EVICT_NONE     0       /* Don't, the new entry is dropped */
+#define SDN_FT_EVICT_LRU      1       /* Least recently hit or installed */
+#define SDN_FT_EVICT_LFU      2       /* Least hit, then least recently */
+#define SDN_FT_EVICT_PRIORITY 3       /* Lowest priority, then least recently */
+#ifdef SDN_CONF_FT_EVICT
+#define SDN_FT_EVICT          SDN_CONF_FT_EVICT
+#else
+#define SDN_FT_EVICT          SDN_FT_EVICT_LRU
+#endif
+
+/* Packets are checked against the whitelist, the default entry, then the
+   flowtable, and anything that misses all of them is queried or sent to the
+   fallback interface. Within a table the highest priority match wins, and
+   entries with the same priority are hit in the order they were installed */
+#define SDN_FT_PRIORITY_MIN   0
+#define SDN_FT_PRIORITY_MAX   255
+#ifdef SDN_CONF_FT_PRIORITY_DEFAULT
+#define SDN_FT_PRIORITY_DEFAULT SDN_CONF_FT_PRIORITY_DEFAULT
+#else
+#define SDN_FT_PRIORITY_DEFAULT 128
+#endif
+
 typedef enum flowtable_id {
   WHITELIST,
   FLOWTABLE
@@ -89,7 +162,8 @@ typedef enum __attribute__((__packed__)) ft_match_op {
   EQ     =     0,
   GT     =     1,
   GT_EQ  =     2,
-  NOT_EQ =     3
+  NOT_EQ =     3,
+  MASK   =     4      /* (field & mask) == value, data is value then mask */
 } sdn_ft_match_op_t;
 
 typedef enum __attribute__((__packed__)) ft_action_type {
@@ -111,21 +185,26 @@ typedef struct __attribute__((__packed__)) ft_match_rule{
   uint8_t             index;          /**< field index within uip_buf */
   uint8_t             len;            /**< length of the field in uip_buf */
   uint8_t             req_ext;        /**< requires ext_header_len */
+  uint8_t             matcher;        /**< compare routine, picked on create */
   void                *data;          /**< data to evaluate against */
+  struct ft_match_rule *next;         /**< further matches, which all must hit */
 } sdn_ft_match_rule_t;
-#define sdn_ft_match_length(m) sizeof(sdn_ft_match_rule_t) - \
-                               sizeof(void*) + \
-                               m.len
+/* Bytes of match data. MASK matches have a mask after the value */
+#define sdn_ft_match_data_len(m) ((m)->operator == MASK ? 2 * (m)->len : (m)->len)
 #define SDN_FT_MATCH_HDR_LEN sizeof(sdn_ft_match_op_t) + 3
+#define sdn_ft_match_length(m) SDN_FT_MATCH_HDR_LEN + \
+                               sdn_ft_match_data_len(&m)
 
 typedef struct __attribute__((__packed__)) ft_action_rule{
   sdn_ft_action_type_t  action;       /**< action to perform */
   uint8_t               index;        /**< (optional) index in uip_buf */
   uint8_t               len;          /**< (optional) length in uip_buf */
   void                  *data;        /**< (optional) data to use */
+  struct ft_action_rule *next;        /**< run next if this one accepts */
+  void                  *hint;        /**< driver's cached lookup (e.g. nbr) */
 } sdn_ft_action_rule_t;
 #define sdn_ft_action_length(a) sizeof(sdn_ft_action_rule_t) - \
-                                sizeof(void*) + \
+                                3 * sizeof(void*) + \
                                 a.len
 
 typedef struct stats_rule{
@@ -135,16 +214,31 @@ typedef struct stats_rule{
 
 typedef struct ft_entry {
   struct ft_entry *next;
+  struct ft_entry *inext;             /**< next in hash bucket / linear chain */
   uint8_t id;
-  // TODO: Introduce *<---->* relationship
-  // LIST_STRUCT(matches_list);
-  // LIST_STRUCT(actions_list);
-  sdn_ft_match_rule_t *match_rule;
-  sdn_ft_action_rule_t *action_rule;
+  uint8_t priority;                   /**< higher is checked first */
+  sdn_ft_match_rule_t *match_rule;    /**< first of the entry's matches */
+  sdn_ft_action_rule_t *action_rule;  /**< first of the entry's actions */
   sdn_ft_stats_t stats;
-  struct ctimer lifetimer;
+  struct ft_entry *wnext;             /**< next in timing wheel slot */
+  clock_time_t last_hit;              /**< time of install or last match */
+  clock_time_t lifetime;              /**< time to live after last_hit */
+  clock_time_t last_used;             /**< time of install or last match, for
+                                           eviction */
+  uint8_t slot;                       /**< timing wheel slot */
+  uint8_t hard;                       /**< lifetime runs from install, hits
+                                           don't refresh it */
 } sdn_ft_entry_t;
 
+/* Match/action data arena usage */
+typedef struct ft_data_stats {
+  uint16_t size;                      /**< arena size */
+  uint16_t used;                      /**< bytes in allocated blocks */
+  uint16_t requested;                 /**< bytes requested by those blocks */
+  uint16_t free_listed;               /**< bytes in freed blocks awaiting reuse */
+  uint16_t failed;                    /**< number of failed allocations */
+} sdn_ft_data_stats_t;
+
 /*---------------------------------------------------------------------------*/
 /* Callback Functions */
 /*---------------------------------------------------------------------------*/
@@ -155,20 +249,37 @@ typedef int (* sdn_ft_action_handler_callback_t)(sdn_ft_action_rule_t *action,
                                                  uint8_t *data);
 sdn_ft_action_handler_callback_t ft_action_handler;
 
+/* Called with an entry which is about to be evicted to make room for a new
+   one, so the engine can let the controller know */
+typedef void (* sdn_ft_evict_callback_t)(sdn_ft_entry_t *e);
+
 /*---------------------------------------------------------------------------*/
 /* SDN Flowtable API */
 /*---------------------------------------------------------------------------*/
 void sdn_ft_init();
 void sdn_ft_register_action_handler(sdn_ft_action_handler_callback_t callback);
+void sdn_ft_register_evict_handler(sdn_ft_evict_callback_t callback);
 uint8_t sdn_ft_check_default(void *data, uint8_t length, uint8_t ext_len);
 int sdn_ft_check(flowtable_id_t id, void *data, uint16_t len, uint8_t ext_len);
+sdn_ft_entry_t *sdn_ft_lookup(flowtable_id_t id, void *data, uint16_t len, uint8_t ext_len);
+uint8_t sdn_ft_entry_match(sdn_ft_entry_t *e, void *data, uint16_t len, uint8_t ext_len);
+int sdn_ft_entry_do_actions(sdn_ft_entry_t *e, void *data);
 uint8_t sdn_ft_contains(void *data, uint8_t len);
+/* Whether the flowtable has an entry with this match and action */
+int sdn_ft_entry_exists(sdn_ft_match_rule_t *match, sdn_ft_action_rule_t *action);
+int sdn_ft_do_match(sdn_ft_match_rule_t *match_rule, uint8_t *data, uint8_t ext_len);
 
 sdn_ft_entry_t *sdn_ft_create_entry(flowtable_id_t id,
                                     sdn_ft_match_rule_t *match,
                                     sdn_ft_action_rule_t *action,
                                     clock_time_t lifetime,
                                     uint8_t is_default);
+sdn_ft_entry_t *sdn_ft_create_entry_priority(flowtable_id_t id,
+                                             sdn_ft_match_rule_t *match,
+                                             sdn_ft_action_rule_t *action,
+                                             clock_time_t lifetime,
+                                             uint8_t is_default,
+                                             uint8_t priority);
 sdn_ft_match_rule_t *sdn_ft_create_match(sdn_ft_match_op_t operator,
                                          uint8_t index,
                                          uint8_t len,
@@ -178,6 +289,15 @@ sdn_ft_action_rule_t *sdn_ft_create_action(sdn_ft_action_type_t action,
                                            uint8_t index,
                                            uint8_t len,
                                            void *data);
+/* Chain another match (or action) onto one, for entries that need several.
+   If either is NULL the other is freed and NULL is returned */
+sdn_ft_match_rule_t *sdn_ft_chain_match(sdn_ft_match_rule_t *m,
+                                        sdn_ft_match_rule_t *next);
+sdn_ft_action_rule_t *sdn_ft_chain_action(sdn_ft_action_rule_t *a,
+                                          sdn_ft_action_rule_t *next);
+/* Clear a hint from every action that has it, when it's no longer valid */
+void sdn_ft_forget_hint(void *hint);
+void sdn_ft_get_data_stats(sdn_ft_data_stats_t *stats);
 void print_sdn_ft(flowtable_id_t id);
 void print_sdn_ft_entry(sdn_ft_entry_t *e);
 void print_sdn_ft_match(sdn_ft_match_rule_t *m);
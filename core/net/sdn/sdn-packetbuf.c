@@ -55,29 +55,239 @@
 #define LOG_MODULE "SDN-BUF"
 #define LOG_LEVEL LOG_LEVEL_SDN
 
-#define ID_MAX   255
-static int current_id = 0;
+#define ID_MAX   0xFFFF
+static uint16_t current_id = 0;
 #define generate_id() (++current_id % ID_MAX)
 
+/* Packet data pool. Each packet's data is a block of [header][data], packed
+   from the start of the pool. Freeing a block moves the blocks after it
+   down, so the free space is never fragmented. */
+typedef struct pb_block {
+  sdn_bufpkt_t *owner;
+  uint16_t size;                /* Size of the whole block */
+} pb_block_t;
+
+#define BLOCK_ALIGN(n)  (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+#define BLOCK_SIZE(len) BLOCK_ALIGN(sizeof(pb_block_t) + (len))
+
+static void *pool_aligned[BLOCK_SIZE(SDN_PACKET_BUF_SIZE) / sizeof(void *)];
+#define pool      ((uint8_t *)pool_aligned)
+#define POOL_SIZE sizeof(pool_aligned)
+static uint16_t pool_used;
+
+/* One timer for all the buffered packets, set for the first to expire.
+   Packets are expected to all be on one list (the driver's). */
+static struct ctimer lifetimer;
+static uint8_t hold;
+
+#define EXPIRED(t, now) ((clock_time_t)((now) - (t)) < ((clock_time_t)~0 >> 1))
+
+#define IN_POOL(ptr) ((uint8_t *)(ptr) >= pool && \
+                      (uint8_t *)(ptr) < pool + POOL_SIZE)
+
+/*---------------------------------------------------------------------------*/
+/* Packet Data Pool */
+/*---------------------------------------------------------------------------*/
+static uint8_t *
+pool_alloc(sdn_bufpkt_t *p, uint16_t len)
+{
+  pb_block_t *b;
+  uint16_t size = BLOCK_SIZE(len);
+
+  if(pool_used + size > POOL_SIZE) {
+    return NULL;
+  }
+  b = (pb_block_t *)&pool[pool_used];
+  b->owner = p;
+  b->size = size;
+  pool_used += size;
+  LOG_ANNOTATE("#A pb=%d/%d\n", pool_used, (int)POOL_SIZE);
+  return (uint8_t *)(b + 1);
+}
+
 /*---------------------------------------------------------------------------*/
 static void
-packet_timedout(void *ptr)
+pool_free(sdn_bufpkt_t *p)
 {
-  sdn_bufpkt_t *p = ptr;
-  LOG_DBG("TIMEOUT Packet timed out! p=%p, id=%d\n", p, p->id);
-  sdn_pbuf_free(p);
+  pb_block_t *b;
+  uint16_t offset, size;
+
+  if(!IN_POOL(p->packet_buf)) {
+    return;
+  }
+  b = (pb_block_t *)p->packet_buf - 1;
+  offset = (uint8_t *)b - pool;
+  size = b->size;
+  /* Move everything after the block down, and tell the owners */
+  memmove(b, (uint8_t *)b + size, pool_used - offset - size);
+  pool_used -= size;
+  for(; offset < pool_used; offset += b->size) {
+    b = (pb_block_t *)&pool[offset];
+    b->owner->packet_buf = (uint8_t *)(b + 1);
+  }
+  p->packet_buf = NULL;
+  LOG_ANNOTATE("#A pb=%d/%d\n", pool_used, (int)POOL_SIZE);
 }
 
 /*---------------------------------------------------------------------------*/
+#if SDN_PACKET_BUF_FLOW_QUOTA
+static int
+flow_length(list_t list, uint16_t id)
+{
+  sdn_bufpkt_t *p;
+  int n = 0;
+  for(p = list_head(list); p != NULL; p = list_item_next(p)) {
+    if(p->id == id) {
+      n++;
+    }
+  }
+  return n;
+}
+#endif /* SDN_PACKET_BUF_FLOW_QUOTA */
+
+/*---------------------------------------------------------------------------*/
+/* Returns the oldest packet in the list (with the id, if not NULL) */
+static sdn_bufpkt_t *
+oldest(list_t list, uint16_t *id)
+{
+  sdn_bufpkt_t *p;
+  for(p = list_head(list); p != NULL; p = list_item_next(p)) {
+    if(id == NULL || p->id == *id) {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Makes sure there's a free packet and len bytes in the pool, evicting
+   buffered packets if we are configured to. Returns 0 if there's no room. */
+static int
+make_room(struct memb *memb, list_t list, uint16_t *id, uint16_t len)
+{
+  sdn_bufpkt_t *p;
+
+#if SDN_PACKET_BUF_FLOW_QUOTA
+  if(id != NULL) {
+    while(flow_length(list, *id) >= SDN_PACKET_BUF_FLOW_QUOTA) {
+      if(SDN_PACKET_BUF_EVICT == SDN_PB_EVICT_NONE ||
+         (p = oldest(list, id)) == NULL) {
+        LOG_WARN("Flow quota reached (id=%d)\n", *id);
+        return 0;
+      }
+      LOG_DBG("EVICT packet (id=%d) for flow quota\n", p->id);
+      sdn_pbuf_free(p);
+    }
+  }
+#endif /* SDN_PACKET_BUF_FLOW_QUOTA */
+
+  while(memb_numfree(memb) == 0 || pool_used + BLOCK_SIZE(len) > POOL_SIZE) {
+    if(SDN_PACKET_BUF_EVICT == SDN_PB_EVICT_NONE ||
+       (p = oldest(list, NULL)) == NULL) {
+      return 0;
+    }
+    LOG_DBG("EVICT packet (id=%d)\n", p->id);
+    sdn_pbuf_free(p);
+  }
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Packet Lifetimes */
+/*---------------------------------------------------------------------------*/
+static void packets_timedout(void *ptr);
+
+/*---------------------------------------------------------------------------*/
+static void
+set_timer(list_t list)
+{
+  sdn_bufpkt_t *p, *first = NULL;
+  clock_time_t now = clock_time();
+
+  for(p = list_head(list); p != NULL; p = list_item_next(p)) {
+    if(first == NULL || EXPIRED(p->expires, first->expires)) {
+      first = p;
+    }
+  }
+  if(first == NULL) {
+    ctimer_stop(&lifetimer);
+  } else if(EXPIRED(first->expires, now)) {
+    ctimer_set(&lifetimer, 0, packets_timedout, list);
+  } else {
+    ctimer_set(&lifetimer, first->expires - now, packets_timedout, list);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+packets_timedout(void *ptr)
+{
+  list_t list = ptr;
+  sdn_bufpkt_t *p, *next;
+  clock_time_t now = clock_time();
+
+  if(hold) {
+    /* Packets are being worked on, we'll be rearmed on release */
+    return;
+  }
+  for(p = list_head(list); p != NULL; p = next) {
+    next = list_item_next(p);
+    if(EXPIRED(p->expires, now)) {
+      LOG_DBG("TIMEOUT Packet timed out! p=%p, id=%d\n", p, p->id);
+      sdn_pbuf_free(p);
+    }
+  }
+  set_timer(list);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Packet Buffer API */
+/*---------------------------------------------------------------------------*/
+void
+sdn_pbuf_init(void)
+{
+  pool_used = 0;
+  hold = 0;
+  ctimer_stop(&lifetimer);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Stops packets in the list timing out until sdn_pbuf_release(), so a batch
+   of packets can be worked through without touching the timer for each */
+void
+sdn_pbuf_hold(list_t list)
+{
+  hold = 1;
+}
+
+/*---------------------------------------------------------------------------*/
+void
+sdn_pbuf_release(list_t list)
+{
+  hold = 0;
+  set_timer(list);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Allocates a packet with room for buf_len bytes of data, to be filled in
+   with sdn_pbuf_set() */
 sdn_bufpkt_t *
-sdn_pbuf_allocate(struct memb *memb, list_t list, clock_time_t lifetime, uint8_t *id)
+sdn_pbuf_allocate(struct memb *memb, list_t list, clock_time_t lifetime,
+                  uint16_t *id, uint16_t buf_len)
 {
   sdn_bufpkt_t *p = NULL;
+  if(buf_len > SDN_PACKET_BUF_SIZE || !make_room(memb, list, id, buf_len)) {
+    LOG_ERR("Failed to alloc a packet (len=%d)\n", buf_len);
+    return NULL;
+  }
   p = memb_alloc(memb);
   if(p == NULL) {
     LOG_ERR("Failed to alloc a packet\n");
     return NULL;
   }
+  p->packet_buf = pool_alloc(p, buf_len);
+  p->buf_len = 0;
+  p->ext_len = 0;
   if (id != NULL) {
     p->id = *id;
   } else {
@@ -88,8 +298,13 @@ sdn_pbuf_allocate(struct memb *memb, list_t list, clock_time_t lifetime, uint8_t
   list_add(list, p);
   p->memb = memb;
   p->list = list;
-  /* Set the packet lifetimer */
-  ctimer_set(&p->lifetimer, lifetime, packet_timedout, p);
+  /* Set the packet lifetime. The timer only needs setting if this is now
+     the first packet to expire. */
+  p->expires = clock_time() + lifetime;
+  if(!hold && (ctimer_expired(&lifetimer) ||
+     EXPIRED(p->expires, etimer_expiration_time(&lifetimer.etimer)))) {
+    ctimer_set(&lifetimer, lifetime, packets_timedout, list);
+  }
   LOG_DBG("Added a packet to buf (%p) (id=%d)!\n", p, p->id);
   return p;
 }
@@ -99,8 +314,11 @@ void
 sdn_pbuf_free(sdn_bufpkt_t* p)
 {
   if(p != NULL) {
-    ctimer_stop(&p->lifetimer);
     list_remove(p->list, p);
+    if(list_head(p->list) == NULL) {
+      ctimer_stop(&lifetimer);
+    }
+    pool_free(p);
     LOG_DBG("Removed packet (%p) (id=%d) from buf!\n", p, p->id);
     int res = memb_free(p->memb, p);
     if (res !=0){
@@ -135,17 +353,39 @@ void
 sdn_pbuf_set(sdn_bufpkt_t *p, uint8_t *buf, uint16_t buf_len, uint8_t ext_len)
 {
   if(p != NULL) {
-    memcpy(&p->packet_buf, buf, buf_len);
+    if(!IN_POOL(p->packet_buf) ||
+       buf_len > ((pb_block_t *)p->packet_buf - 1)->size - sizeof(pb_block_t)) {
+      LOG_ERR("Packet (%p) has no room for len=%d!\n", p, buf_len);
+      return;
+    }
+    memcpy(p->packet_buf, buf, buf_len);
     p->buf_len = buf_len;
     p->ext_len = ext_len;
+    LOG_DBG("Set packet (%p) (id=%d, len=%d, ext=%d)!",
+             p, p->id, p->buf_len, p->ext_len);
   }
-  LOG_DBG("Set packet (%p) (id=%d, len=%d, ext=%d)!",
-           p, p->id, p->buf_len, p->ext_len);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Points a (not allocated) packet at buf, without copying */
+void
+sdn_pbuf_wrap(sdn_bufpkt_t *p, uint8_t *buf, uint16_t buf_len, uint8_t ext_len)
+{
+  p->packet_buf = buf;
+  p->buf_len = buf_len;
+  p->ext_len = ext_len;
+}
+
+/*---------------------------------------------------------------------------*/
+uint16_t
+sdn_pbuf_bytes_used(void)
+{
+  return pool_used;
 }
 
 /*---------------------------------------------------------------------------*/
 sdn_bufpkt_t *
-sdn_pbuf_find(list_t list, uint8_t id)
+sdn_pbuf_find(list_t list, uint16_t id)
 {
   sdn_bufpkt_t *p;
   for(p = list_head(list); p != NULL; p = list_item_next(p)) {
@@ -203,7 +443,7 @@ sdn_pbuf_contains(list_t list, uint8_t *buf, uint16_t buf_len, uint8_t *index, u
  sdn_bufpkt_t *p;
  static sdn_bufpkt_t q;
  /* Set the packet for comparing */
- sdn_pbuf_set(&q, buf, buf_len, 0);
+ sdn_pbuf_wrap(&q, buf, buf_len, 0);
  /* Search through the buffer and compare packets */
  for(p = list_head(list); p != NULL; p = list_item_next(p)) {
    if((index != NULL) && (len != NULL)) {
@@ -240,7 +480,7 @@ print_sdn_pbuf_packet(sdn_bufpkt_t *p, sdn_pb_print_level_t level)
   int idx_udp_pld = UIP_IPUDPH_LEN + UIP_LLH_LEN;
 
   LOG_DBG("packet=%p | id=%d | timer=(%ld) data=[", p, p->id,
-           timer_remaining(&p->lifetimer.etimer.timer));
+           (long)(p->expires - clock_time()));
   switch(level)
   {
     case SDN_PB_PRINT_UDP:
@@ -257,7 +497,7 @@ print_sdn_pbuf_packet(sdn_bufpkt_t *p, sdn_pb_print_level_t level)
       break;
     default:
       for(i = 0; i < p->buf_len; i++) {
-        LOG_DBG(" %x\n", ((unsigned char *)&p->packet_buf)[i]);
+        LOG_DBG(" %x\n", p->packet_buf[i]);
       }
       break;
   }
@@ -46,10 +46,36 @@
 #define SDN_PACKETBUF_LIFETIME CLOCK_SECOND * 4
 #endif
 
+/* Max number of buffered packets */
 #ifdef SDN_CONF_PACKETBUF_LEN
 #define SDN_PACKET_BUF_LEN SDN_CONF_PACKETBUF_LEN
 #else
-#define SDN_PACKET_BUF_LEN 1
+#define SDN_PACKET_BUF_LEN 8
+#endif
+
+/* Bytes shared between all buffered packets. Each packet takes its length
+   plus a small header. Defaults to enough for one full uip_buf. */
+#ifdef SDN_CONF_PACKETBUF_SIZE
+#define SDN_PACKET_BUF_SIZE SDN_CONF_PACKETBUF_SIZE
+#else
+#define SDN_PACKET_BUF_SIZE (UIP_BUFSIZE - UIP_LLH_LEN)
+#endif
+
+/* What to do when there isn't room for a new packet */
+#define SDN_PB_EVICT_NONE    0  /* Drop the new packet */
+#define SDN_PB_EVICT_OLDEST  1  /* Drop the oldest buffered packets */
+#ifdef SDN_CONF_PACKETBUF_EVICT
+#define SDN_PACKET_BUF_EVICT SDN_CONF_PACKETBUF_EVICT
+#else
+#define SDN_PACKET_BUF_EVICT SDN_PB_EVICT_OLDEST
+#endif
+
+/* Max packets buffered with the same id (i.e. for the same query). Stops
+   one flow taking the whole buffer. 0 for no limit. */
+#ifdef SDN_CONF_PACKETBUF_FLOW_QUOTA
+#define SDN_PACKET_BUF_FLOW_QUOTA SDN_CONF_PACKETBUF_FLOW_QUOTA
+#else
+#define SDN_PACKET_BUF_FLOW_QUOTA 0
 #endif
 
 typedef enum {
@@ -60,21 +86,26 @@ typedef enum {
 /* SDN buffer packetd */
 typedef struct sdn_bufpkt {
   struct sdn_packet *next;
-  uint8_t id;
-  uint8_t packet_buf[UIP_BUFSIZE - UIP_LLH_LEN];
+  uint16_t id;                /* tx_id of the query the packet waits on */
+  uint8_t *packet_buf;        /* In the packet buffer pool, see sdn_pbuf_set */
   uint16_t buf_len;
   uint8_t ext_len;
   struct memb *memb;
   list_t list;
-  struct ctimer lifetimer;
+  clock_time_t expires;       /* See sdn_pbuf_allocate */
 } sdn_bufpkt_t;
 
 /*---------------------------------------------------------------------------*/
 /* uSDN Packet Buffer API */
-sdn_bufpkt_t *sdn_pbuf_allocate(struct memb *memb, list_t list, clock_time_t lifetime, uint8_t *id);
+void sdn_pbuf_init(void);
+sdn_bufpkt_t *sdn_pbuf_allocate(struct memb *memb, list_t list, clock_time_t lifetime, uint16_t *id, uint16_t buf_len);
 void sdn_pbuf_free(sdn_bufpkt_t *p);
 void sdn_pbuf_set(sdn_bufpkt_t *p, uint8_t *buf, uint16_t buf_len, uint8_t ext_len);
-sdn_bufpkt_t *sdn_pbuf_find(list_t list, uint8_t id);
+void sdn_pbuf_wrap(sdn_bufpkt_t *p, uint8_t *buf, uint16_t buf_len, uint8_t ext_len);
+uint16_t sdn_pbuf_bytes_used(void);
+sdn_bufpkt_t *sdn_pbuf_find(list_t list, uint16_t id);
+void sdn_pbuf_hold(list_t list);
+void sdn_pbuf_release(list_t list);
 sdn_bufpkt_t *sdn_pbuf_contains(list_t list, uint8_t *buf, uint16_t buf_len, uint8_t *index, uint8_t *len);
 uint8_t *sdn_pbuf_buf(sdn_bufpkt_t *p);
 uint16_t sdn_pbuf_buflen(sdn_bufpkt_t *p);
@@ -126,6 +126,21 @@ sdn_get_action_data_srh(sdn_ft_action_rule_t *rule, sdn_srh_route_t *route)
   }
 }
 
+/*---------------------------------------------------------------------------*/
+/* Returns the precompiled SRH following the route, if the action has one */
+sdn_srh_compiled_t *
+sdn_get_action_data_srh_compiled(sdn_ft_action_rule_t *rule)
+{
+  uint8_t route_len;
+  if(rule->action == SDN_FT_ACTION_SRH && rule->len > 2) {
+    route_len = 2 + ((uint8_t *)rule->data)[1] * sizeof(sdn_node_id_t);
+    if(rule->len > route_len) {
+      return (sdn_srh_compiled_t *)((uint8_t *)rule->data + route_len);
+    }
+  }
+  return NULL;
+}
+
 /*---------------------------------------------------------------------------*/
 /* SDN Controller State */
 /*---------------------------------------------------------------------------*/
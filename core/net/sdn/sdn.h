@@ -49,7 +49,8 @@
 typedef enum SDN_FLAG {
   RPL_SRH,
   SDN_UIP,
-  SDN_UDP
+  SDN_UDP,
+  SDN_CTRL
 } sdn_flag_t;
 
 /*---------------------------------------------------------------------------*/
@@ -58,6 +59,7 @@ typedef enum SDN_FLAG {
 
 /* Offset values for various IP header fields */
 #define UIP_IPH_LEN_OFFSET        4
+#define UIP_IPH_PROTO_OFFSET      6
 #define UIP_IPH_SRC_OFFSET        8
 #define UIP_IPH_DST_OFFSET        24
 
@@ -71,6 +73,7 @@ typedef enum SDN_FLAG {
 
 /* Index values for datagram fields used within the engine */
 #define uip_len_index (UIP_LLH_LEN + UIP_IPH_LEN_OFFSET)
+#define uip_proto_index (UIP_LLH_LEN + UIP_IPH_PROTO_OFFSET)
 #define uip_src_index (UIP_LLH_LEN + UIP_IPH_SRC_OFFSET)
 #define uip_dst_index (UIP_LLH_LEN + UIP_IPH_DST_OFFSET)
 #define uip_icmp_type_index (uip_l2_l3_hdr_len + UIP_ICMPH_TYPE_OFFSET)
@@ -113,6 +116,17 @@ typedef struct sdn_srh_route {
                                 sizeof(route->length) + \
                                 (sizeof(sdn_node_id_t) * route->length)
 
+/* Precompiled SRH, stored after the route in SRH action data so it only
+   needs copying into each packet. See sdn_ext_compile_srh(). */
+typedef struct sdn_srh_compiled {
+  uint8_t ext_len;          /* Length of hdr */
+  uint8_t dest_lsb;         /* Last byte of the first hop's address */
+  uint8_t hdr[];            /* RH + SRH + hops + padding, next is set later */
+} sdn_srh_compiled_t;
+#define SDN_SRH_COMPILED_MAX    (sizeof(sdn_srh_compiled_t) + \
+                                 SDN_RH_LEN + SDN_SRH_LEN + \
+                                 SDN_CONF_MAX_ROUTE_LEN + 7)
+
 /*---------------------------------------------------------------------------*/
 /* Global SDN Buffers and Headers */
 /*---------------------------------------------------------------------------*/
@@ -216,6 +230,9 @@ struct sdn_engine {
   void (* controller_join)(sdn_tmr_state_t state);
   void (* controller_update)(sdn_tmr_state_t state);
   void (* controller_query)(void *data);
+  /* Another node's message to the controller is passing through. Returns
+     non-zero if the engine has taken it to send on itself */
+  uint8_t (* controller_forward)(void);
 };
 
 extern const struct sdn_engine SDN_ENGINE;
@@ -247,6 +264,11 @@ struct uip_sdn_driver {
   void (* add_accept_on_dest)(flowtable_id_t id, uip_ipaddr_t *dest);
   void (* add_accept_on_icmp6_type)(flowtable_id_t id, uint8_t type);
   void (* add_do_callback_on_dest)(flowtable_id_t id, uip_ipaddr_t *dest, sdn_ft_callback_action_ipaddr_t callback);
+
+  /* Called when a neighbor is added to the ds6 neighbor table */
+  void (* nbr_added)(uip_ds6_nbr_t *nbr);
+  /* Called when a neighbor is removed from the ds6 neighbor table */
+  void (* nbr_removed)(uip_ds6_nbr_t *nbr);
 };
 
 /* Choose a SDN driver or turn off based on user configuration */
@@ -364,9 +386,15 @@ uint8_t sdn_rpl_get_current_instance_rank(void);
 
 /* Flowtable data conversion */
 void sdn_get_action_data_srh(sdn_ft_action_rule_t *rule, sdn_srh_route_t *route);
+sdn_srh_compiled_t *sdn_get_action_data_srh_compiled(sdn_ft_action_rule_t *rule);
 
 /* Extension header functions */
 int sdn_ext_insert_srh(sdn_srh_route_t *route);
+uint8_t sdn_ext_compile_srh(sdn_srh_route_t *route, uint8_t *buf);
+int sdn_ext_insert_srh_compiled(sdn_srh_compiled_t *srh);
+int sdn_ext_attach_srh_compiled(sdn_srh_compiled_t *srh);
+void sdn_ext_detach_srh(void);
+uint8_t sdn_ext_srh_attached(void);
 
 /* Print functions */
 void print_sdn_srh_route(sdn_srh_route_t *route);
@@ -66,9 +66,26 @@
 MEMB(sdn_pbuf_memb, sdn_bufpkt_t, SDN_PACKET_BUF_LEN);
 LIST(sdn_pbuf_list);
 
+#if SDN_CONF_QUERY_TABLE_LEN
+/* Queries we are waiting on the controller for */
+typedef struct sdn_query {
+  struct sdn_query *next;
+  uint16_t id;                              /* tx_id of the ftq */
+  uint8_t key_len;
+  uint8_t key[SDN_CONF_QUERY_KEY_LEN];      /* Queried bytes of the packet */
+  struct timer lifetimer;
+} sdn_query_t;
+MEMB(sdn_query_memb, sdn_query_t, SDN_CONF_QUERY_TABLE_LEN);
+LIST(sdn_query_list);
+#endif /* SDN_CONF_QUERY_TABLE_LEN */
+
 /* UIP Send length for when we're clearing the out buffer */
 extern uint16_t uip_slen;
 
+/* Whether we are the source of the packet being processed, so sdn_fwd()
+   knows not to decrement its hop limit. Worked out once per packet */
+static uint8_t fwd_from_me;
+
 /* uIPv6 Pointers */
 #define UIP_BUF          ((uint8_t *)&uip_buf[UIP_LLH_LEN])
 #define UIP_IP_BUF       ((struct uip_ip_hdr *)&uip_buf[UIP_LLH_LEN])
@@ -158,7 +175,7 @@ usdn_add_srh_on_dest(flowtable_id_t id, uip_ipaddr_t *dest, sdn_node_id_t *path,
   sdn_srh_route_t route;
   route.cmpr = 15;
   route.length = len;
-  memcpy(&route.nodes, path, len);
+  memcpy(&route.nodes, path, len * sizeof(sdn_node_id_t));
   /* Work out the length of the route data */
   uint8_t length = sizeof(route.cmpr) + sizeof(route.length) +
                    (route.length * sizeof(sdn_node_id_t));
@@ -264,6 +281,82 @@ copy_buf_packet_to_uip(sdn_bufpkt_t *p) {
   memcpy(&uip_buf, sdn_pbuf_buf(p), uip_len);
 }
 
+#if SDN_CONF_QUERY_TABLE_LEN
+/*---------------------------------------------------------------------------*/
+/* Query Table */
+/*---------------------------------------------------------------------------*/
+static void
+query_free(sdn_query_t *q)
+{
+  list_remove(sdn_query_list, q);
+  memb_free(&sdn_query_memb, q);
+  LOG_ANNOTATE("#A q=%d/%d\n", list_length(sdn_query_list),
+               SDN_CONF_QUERY_TABLE_LEN);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Returns the outstanding query for the packet in the uip_buf, if any.
+   Expired queries (i.e. we never got a response) are removed so that we
+   query again. */
+static sdn_query_t *
+query_find(void)
+{
+  sdn_query_t *q, *next;
+  uint8_t *key = UIP_BUF + (SDN_CONF.query_idx - UIP_LLH_LEN);
+
+  if(SDN_CONF.query_full || SDN_CONF.query_len > SDN_CONF_QUERY_KEY_LEN) {
+    return NULL;
+  }
+  for(q = list_head(sdn_query_list); q != NULL; q = next) {
+    next = list_item_next(q);
+    if(timer_expired(&q->lifetimer)) {
+      LOG_DBG("QUERY tx_id (%d) timed out\n", q->id);
+      query_free(q);
+    } else if(q->key_len == SDN_CONF.query_len &&
+              memcmp(q->key, key, q->key_len) == 0) {
+      return q;
+    }
+  }
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+query_add(uint16_t id)
+{
+  sdn_query_t *q;
+
+  if(SDN_CONF.query_full || SDN_CONF.query_len > SDN_CONF_QUERY_KEY_LEN) {
+    return;
+  }
+  q = memb_alloc(&sdn_query_memb);
+  if(q == NULL) {
+    LOG_WARN("QUERY table full, tx_id (%d) won't be shared\n", id);
+    return;
+  }
+  q->id = id;
+  q->key_len = SDN_CONF.query_len;
+  memcpy(q->key, UIP_BUF + (SDN_CONF.query_idx - UIP_LLH_LEN), q->key_len);
+  timer_set(&q->lifetimer, SDN_PACKETBUF_LIFETIME);
+  list_add(sdn_query_list, q);
+  LOG_ANNOTATE("#A q=%d/%d\n", list_length(sdn_query_list),
+               SDN_CONF_QUERY_TABLE_LEN);
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+query_remove(uint16_t id)
+{
+  sdn_query_t *q;
+  for(q = list_head(sdn_query_list); q != NULL; q = list_item_next(q)) {
+    if(q->id == id) {
+      query_free(q);
+      return;
+    }
+  }
+}
+#endif /* SDN_CONF_QUERY_TABLE_LEN */
+
 /*---------------------------------------------------------------------------*/
 /* Action Handler Functions */
 /*---------------------------------------------------------------------------*/
@@ -274,18 +367,21 @@ sdn_fwd(uip_ds6_nbr_t *nbr)
 {
 
   // If we aren't the source, then decrement ttl
-  if(uip_ds6_addr_lookup(&UIP_IP_BUF->srcipaddr) == NULL) {
+  if(!fwd_from_me) {
     UIP_IP_BUF->ttl--;
   }
 
-  /* See if there is a srh nexthop */
+  /* See if there is a srh nexthop. An attached SRH has already been
+     processed, and nbr is its first hop */
   uip_ipaddr_t *nexthop = NULL;
-  if(uip_ext_len > 0) {
+  if(uip_ext_len > 0 && !sdn_ext_srh_attached()) {
     LOG_DBG("FORWARD ext_length is %d\n", uip_ext_len);
-    rpl_process_srh_header();
     uip_ipaddr_t ipaddr;
+    rpl_process_srh_header();
     if(rpl_srh_get_next_hop(&ipaddr)) {
       nexthop = &ipaddr;
+    }
+    if(nexthop != NULL) {
       nbr = uip_ds6_nbr_lookup(nexthop);
       if (nbr == NULL) {
         LOG_ERR("FORWARD Could not find NBR\n");
@@ -319,11 +415,11 @@ sdn_fallback(void) {
 
 /*---------------------------------------------------------------------------*/
 static sdn_bufpkt_t *
-buffer_packet(void) {
+buffer_packet(uint16_t *id) {
   sdn_bufpkt_t *p = NULL;
   /* Buffer the packet currently in the sdn_buf. Set new lifetimer. */
   p = sdn_pbuf_allocate(&sdn_pbuf_memb, sdn_pbuf_list,
-                        SDN_PACKETBUF_LIFETIME, NULL);
+                        SDN_PACKETBUF_LIFETIME, id, uip_len);
   if(p != NULL) {
     LOG_ANNOTATE("#A p=%d/%d\n", list_length(sdn_pbuf_list), SDN_PACKET_BUF_LEN);
     sdn_pbuf_set(p, UIP_BUF, uip_len, uip_ext_len);
@@ -343,9 +439,19 @@ sdn_bufpkt_t *
 sdn_query(void) {
   sdn_bufpkt_t *p = NULL;
 
+#if SDN_CONF_QUERY_TABLE_LEN
+  /* If we've already asked the controller about this, then buffer the packet
+     against that query rather than asking again */
+  sdn_query_t *q = query_find();
+  if(q != NULL) {
+    LOG_DBG("QUERY already sent with tx_id (%d)\n", q->id);
+    return buffer_packet(&q->id);
+  }
+#endif /* SDN_CONF_QUERY_TABLE_LEN */
+
 /* Buffer the packet currently in the sdn_buf so we can retry when we get
    a response from the controller */
-  p = buffer_packet();
+  p = buffer_packet(NULL);
 
   /* Check if we are querying the full packet, or only part of it */
   if (!SDN_CONF.query_full) {
@@ -359,9 +465,9 @@ sdn_query(void) {
 
     //FIXME: Need to put this in conf
     /* sdn-packetbuf doesn't use the Link Layer Header, so we need to offset */
-    sdn_pbuf_set(&temp,
-                 UIP_BUF + (SDN_CONF.query_idx - UIP_LLH_LEN),
-                 SDN_CONF.query_len, uip_ext_len);
+    sdn_pbuf_wrap(&temp,
+                  UIP_BUF + (SDN_CONF.query_idx - UIP_LLH_LEN),
+                  SDN_CONF.query_len, uip_ext_len);
     // PRINTFNC(TRACE_LEVEL, print_sdn_pbuf_packet(&temp, SDN_PB_PRINT_DFLT));
     /* Send a query to the controller */
     LOG_DBG("QUERY send query with tx_id (%d)\n", temp.id);
@@ -372,9 +478,64 @@ sdn_query(void) {
     SDN_ENGINE.controller_query(p);
   }
 
+#if SDN_CONF_QUERY_TABLE_LEN
+  /* Remember the query. If we couldn't buffer the packet there's nothing to
+     attach to it. */
+  if(p != NULL) {
+    query_add(p->id);
+  }
+#endif /* SDN_CONF_QUERY_TABLE_LEN */
+
   return p;
 }
 
+/*---------------------------------------------------------------------------*/
+#if SDN_CONF_SPECULATIVE_FWD
+/* Query the controller about the packet in the uip_buf, and have uip send it
+   on the RPL default route meanwhile. */
+static uint8_t
+speculative_query(void)
+{
+  sdn_bufpkt_t *p;
+  struct uip_udp_conn *conn = uip_udp_conn;
+
+#if SDN_CONF_QUERY_TABLE_LEN
+  if(query_find() != NULL) {
+    LOG_DBG("QUERY already sent, forward on RPL (ACCEPT)\n");
+    return UIP_ACCEPT;
+  }
+#endif /* SDN_CONF_QUERY_TABLE_LEN */
+  /* Sending the ftq uses the uip_buf, so the packet is buffered meanwhile */
+  p = sdn_query();
+  uip_udp_conn = conn;
+  if(p == NULL) {
+    LOG_ERR("QUERY packet wasn't buffered, can't forward it (DROP)\n");
+    uip_clear_buf();
+    return UIP_DROP;
+  }
+  copy_buf_packet_to_uip(p);
+  /* It's going now, so there's nothing to retry */
+  sdn_pbuf_free(p);
+  LOG_ANNOTATE("#A p=%d/%d\n", list_length(sdn_pbuf_list), SDN_PACKET_BUF_LEN);
+  return UIP_ACCEPT;
+}
+#endif /* SDN_CONF_SPECULATIVE_FWD */
+
+/*---------------------------------------------------------------------------*/
+/* Neighbor lookups are kept as the action's hint, which is cleared if the
+   neighbor is removed. The address is still checked, as an SRH's first hop
+   can be different for packets hitting a masked match */
+static uip_ds6_nbr_t *
+action_nbr(sdn_ft_action_rule_t *action_rule, const uip_ipaddr_t *ipaddr)
+{
+  uip_ds6_nbr_t *nbr = action_rule->hint;
+  if(nbr == NULL || !uip_ipaddr_cmp(&nbr->ipaddr, ipaddr)) {
+    nbr = uip_ds6_nbr_lookup(ipaddr);
+    action_rule->hint = nbr;
+  }
+  return nbr;
+}
+
 /*---------------------------------------------------------------------------*/
 static int
 action_handler(sdn_ft_action_rule_t *action_rule, uint8_t *data)
@@ -421,7 +582,7 @@ action_handler(sdn_ft_action_rule_t *action_rule, uint8_t *data)
     /* Get the forwarding addr from the action and check to see if we have
        that neighbor */
     // TODO: Should we check uip_ds6_is_addr_onlink?
-    nbr = uip_ds6_nbr_lookup((uip_ipaddr_t *)action_rule->data);
+    nbr = action_nbr(action_rule, (uip_ipaddr_t *)action_rule->data);
     if(nbr != NULL) {
       sdn_fwd(nbr);
       goto drop;
@@ -444,10 +605,29 @@ action_handler(sdn_ft_action_rule_t *action_rule, uint8_t *data)
   /* Insert Source Routing Header (SRH) */
   srh:
     LOG_DBG("ACTION_HANDLER Insert SRH...\n");
-    sdn_srh_route_t srh;
-    sdn_get_action_data_srh(action_rule, &srh);
-    sdn_ext_insert_srh(&srh);
-    sdn_fwd(NULL);
+    sdn_srh_compiled_t *srh_compiled = sdn_get_action_data_srh_compiled(action_rule);
+    if(srh_compiled != NULL) {
+      if(sdn_ext_attach_srh_compiled(srh_compiled)) {
+        /* The first hop is the destination now */
+        uip_ipaddr_t ipaddr;
+        uip_ipaddr_copy(&ipaddr, &UIP_IP_BUF->destipaddr);
+        uip_create_linklocal_prefix(&ipaddr);
+        nbr = action_nbr(action_rule, &ipaddr);
+        if(nbr == NULL) {
+          LOG_ERR("ACTION_HANDLER No ds6 nbr for SRH!\n");
+          sdn_ext_detach_srh();
+          goto drop;
+        }
+      } else {
+        sdn_ext_insert_srh_compiled(srh_compiled);
+      }
+    } else {
+      sdn_srh_route_t srh;
+      sdn_get_action_data_srh(action_rule, &srh);
+      sdn_ext_insert_srh(&srh);
+    }
+    sdn_fwd(nbr);
+    sdn_ext_detach_srh();
     goto drop;
 
   callback:
@@ -476,6 +656,32 @@ init()
 {
   /* Resgister the action handler */
   sdn_ft_register_action_handler(action_handler);
+  sdn_pbuf_init();
+#if SDN_CONF_QUERY_TABLE_LEN
+  memb_init(&sdn_query_memb);
+  list_init(sdn_query_list);
+#endif /* SDN_CONF_QUERY_TABLE_LEN */
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+nbr_added(uip_ds6_nbr_t *nbr)
+{
+#if SDN_CONF_NSU_TRICKLE_DOUBLINGS
+  /* Tell the controller about the new link sooner */
+  SDN_ENGINE.controller_update(SDN_TMR_STATE_RESET);
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+nbr_removed(uip_ds6_nbr_t *nbr)
+{
+  /* Actions must not use the neighbor any more */
+  sdn_ft_forget_hint(nbr);
+#if SDN_CONF_NSU_TRICKLE_DOUBLINGS
+  SDN_ENGINE.controller_update(SDN_TMR_STATE_RESET);
+#endif
 }
 
 /*---------------------------------------------------------------------------*/
@@ -529,6 +735,8 @@ process(uint8_t flag) {
   if(!sdn_connected()) {
     return UIP_ACCEPT;
   }
+  /* Only UDP sends start here, everything else has been received */
+  fwd_from_me = (flag == SDN_UDP);
 
   /* Check why we are looking at the flowtables */
   switch(flag) {
@@ -538,6 +746,9 @@ process(uint8_t flag) {
       goto uip;
     case SDN_UDP:
       goto send;
+    case SDN_CTRL:
+      /* Not ours to route, but the engine might want to hold it */
+      return SDN_ENGINE.controller_forward() ? UIP_DROP : UIP_ACCEPT;
     default:
       LOG_ERR("Unknown flag, return UIP_DROP\n");
       return UIP_DROP;
@@ -585,6 +796,12 @@ send:
           LOG_DBG("No match! But dest is onlink, so we should return to upper layers (ACCEPT).\n");
           return UIP_ACCEPT;
       } else {
+#if SDN_CONF_SPECULATIVE_FWD
+        if(uip_ds6_defrt_choose() != NULL) {
+          LOG_DBG("No match! Dest is NOT onlink. Query controller, and forward on RPL until it answers (ACCEPT)\n");
+          return speculative_query();
+        }
+#endif /* SDN_CONF_SPECULATIVE_FWD */
         LOG_DBG("No match! Dest is NOT onlink. Query controller (BUFFER)\n");
         sdn_query();
         return UIP_DROP;
@@ -601,37 +818,58 @@ send:
 
 
 /*---------------------------------------------------------------------------*/
+/* All buffered packets with the same id were queried together, so should
+   match the same entry. We look it up once and then check each following
+   packet against just that entry's match, before doing its action. */
 static uint8_t
 retry(uint16_t flow)
 {
   sdn_bufpkt_t *p;
-  uint8_t state = UIP_DROP;
+  sdn_ft_entry_t *e = NULL;
+  uint8_t state = SDN_NO_MATCH;
 
   LOG_DBG("RETRY Re-attempt packets with flow id [%d] \n", flow);
-  for(p = list_head(sdn_pbuf_list); p != NULL; p = list_item_next(p)) {
-    if(p->id == flow) {
-      /* Copy the buffered packet back onto the uip_buf */
-      copy_buf_packet_to_uip(p);
-
-      // TODO: Surely any FT match would apply to all buffered packets with the same ID?
-      /* Check if we have an entry in the flowtable for this packet */
-      state = sdn_ft_check(FLOWTABLE, &uip_buf, uip_len, uip_ext_len);
-
-      switch(state) {
-        case UIP_ACCEPT:
-          LOG_DBG("RETRY Pass on to UIP\n");
-          break;
-        case SDN_NO_MATCH:
-          LOG_DBG("RETRY No match (FREE)\n");
-          break;
-        case UIP_DROP:
-          LOG_DBG("RETRY No further processing (FREE)\n");
-          break;
-      }
-      sdn_pbuf_free(p);
-      LOG_ANNOTATE("#A p=%d/%d\n\n", list_length(sdn_pbuf_list), SDN_PACKET_BUF_LEN);
+#if SDN_CONF_QUERY_TABLE_LEN
+  /* We've had our response */
+  query_remove(flow);
+#endif /* SDN_CONF_QUERY_TABLE_LEN */
+
+  /* Don't let packets time out while we're draining them */
+  sdn_pbuf_hold(sdn_pbuf_list);
+  p = list_head(sdn_pbuf_list);
+  while(p != NULL) {
+    if(p->id != flow) {
+      p = list_item_next(p);
+      continue;
+    }
+    /* Copy the buffered packet back onto the uip_buf. It's freed before its
+       actions run, as a query from them can evict buffered packets */
+    copy_buf_packet_to_uip(p);
+    sdn_pbuf_free(p);
+    fwd_from_me = uip_ds6_addr_lookup(&UIP_IP_BUF->srcipaddr) != NULL;
+
+    /* Check if we have an entry in the flowtable for this packet */
+    if(e == NULL || !sdn_ft_entry_match(e, &uip_buf, uip_len, uip_ext_len)) {
+      e = sdn_ft_lookup(FLOWTABLE, &uip_buf, uip_len, uip_ext_len);
+    }
+    state = (e != NULL) ? sdn_ft_entry_do_actions(e, &uip_buf) : SDN_NO_MATCH;
+
+    switch(state) {
+      case UIP_ACCEPT:
+        LOG_DBG("RETRY Pass on to UIP\n");
+        break;
+      case SDN_NO_MATCH:
+        LOG_DBG("RETRY No match (FREE)\n");
+        break;
+      case UIP_DROP:
+        LOG_DBG("RETRY No further processing (FREE)\n");
+        break;
     }
+    /* The actions may have changed the list, so start again */
+    p = list_head(sdn_pbuf_list);
   }
+  sdn_pbuf_release(sdn_pbuf_list);
+  LOG_ANNOTATE("#A p=%d/%d\n\n", list_length(sdn_pbuf_list), SDN_PACKET_BUF_LEN);
 
   LOG_DBG("CLEAR uip_buf (len=%d)\n", uip_len);
   uip_clear_buf();
@@ -651,5 +889,7 @@ const struct uip_sdn_driver usdn_driver = {
   usdn_add_accept_on_src,
   usdn_add_accept_on_dest,
   usdn_add_accept_on_icmp6_type,
-  usdn_add_do_callback_on_dest
+  usdn_add_do_callback_on_dest,
+  nbr_added,
+  nbr_removed
 };
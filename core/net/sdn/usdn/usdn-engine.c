@@ -44,6 +44,7 @@
 #include "net/ip/uip.h"
 #include "net/ip/udp-socket.h"
 #include "net/link-stats.h"
+#include "lib/trickle-timer.h"
 #include "sys/node-id.h"
 
 // FIXME: These are for the packet print function
@@ -72,16 +73,61 @@
 
 //HACK: This is for debugging so we can track the packet
 static uint16_t nsu_count = 0;
+static uint8_t ft_evicted = 0;
 static uint16_t ftq_count = 0;
+#if SDN_CONF_ACK_CONTROLLER
+/* Ids of the last FTS/CFG messages from the controller */
+static uint16_t rx_flows[SDN_CONF_ACK_CONTROLLER];
+static uint8_t rx_flows_idx;
+#endif
 static uint16_t cjoin_count = 0;
 
 /* Controller join timer */
 static struct ctimer join_timer;
 
+#if SDN_CONF_NO_ROUTE_TABLE_LEN
+/* Queries the controller has recently had no route for, so that asking again
+   soon after the drop entry expires backs off for longer */
+typedef struct no_route {
+  struct no_route *next;
+  uint8_t index;
+  uint8_t len;
+  uint8_t key[USDN_CONF_MAX_FTS_DATA];    /* Match data of the drop entry */
+  clock_time_t lifetime;                  /* Lifetime of the last drop entry */
+  struct timer window;                    /* Asking again within this backs off */
+} no_route_t;
+MEMB(no_route_memb, no_route_t, SDN_CONF_NO_ROUTE_TABLE_LEN);
+LIST(no_route_list);
+#endif /* SDN_CONF_NO_ROUTE_TABLE_LEN */
+
 static uint8_t            databuf[60];
 #define USDN_BUF          ((uint8_t *)&databuf)
 #define USDN_BUF_PAYLOAD  ((uint8_t *)&databuf + USDN_H_LEN)
 
+/* Links as we last told the controller about them, so NSUs in between the
+   full ones need only carry the changes */
+static usdn_nsu_link_t    nsu_sent[NBR_TABLE_MAX_NEIGHBORS];
+static uint8_t            nsu_sent_len;
+static uint8_t            nsu_seq;
+static uint8_t            nsu_to_full;     /* NSUs before the next full one */
+static uint8_t            nsu_resync;      /* Sending the rest of a full one */
+#define NSU_MAX_LINKS     ((sizeof(databuf) - USDN_H_LEN - sizeof(usdn_nsu_t)) \
+                           / sizeof(usdn_nsu_link_t))
+
+#if SDN_CONF_NSU_TRICKLE_DOUBLINGS
+/* NSUs back off while our links stay the same */
+static struct trickle_timer nsu_trickle;
+#endif
+
+#if SDN_CONF_NSU_AGGREGATE_WINDOW
+/* NSU records from nodes below us, held to send on with ours */
+static uint8_t            aggbuf[USDN_H_LEN + SDN_CONF_NSU_AGGREGATE_LEN];
+static uint8_t            agg_len;
+static struct ctimer      agg_timer;
+#define AGG_PAYLOAD       ((uint8_t *)&aggbuf + USDN_H_LEN)
+#define UIP_UDP_BUF       ((struct uip_udp_hdr *)&uip_buf[uip_l2_l3_hdr_len])
+#endif
+
 /*---------------------------------------------------------------------------*/
 /* PRINTING */
 /*---------------------------------------------------------------------------*/
@@ -120,10 +166,11 @@ print_usdn_match(usdn_match_t *m)
       case LT: printf("LT "); break;
       case GT_EQ: printf("GT_OR_EQ "); break;
       case LT_EQ: printf("LT_OR_EQ "); break;
+      case MASK: printf("MASK "); break;
       default: printf("UNKNOWN "); break;
     }
     printf("INDEX:%d LEN:%d VAL:[", m->index, m->len);
-    for(i = 0; i < m->len; i++) {
+    for(i = 0; i < sdn_ft_match_data_len(m); i++) {
       printf("%x ", m->data[i]);
     }
   }
@@ -159,10 +206,16 @@ print_usdn_action(usdn_action_t *a)
 void
 print_usdn_fts(usdn_fts_t *fts)
 {
+  int i;
+  usdn_fts_entry_t *e = (usdn_fts_entry_t *)fts->entries;
   printf("fts[");
-  printf("id:%d dflt:%d :: \n", fts->tx_id, fts->is_default);
-  print_usdn_match(&fts->m);
-  print_usdn_action(&fts->a);
+  printf("id:%d f:%x n:%d ::\n", fts->tx_id, fts->flags, fts->num_entries);
+  for(i = 0; i < fts->num_entries; i++) {
+    printf("USDN:   E = FLAGS:%x PRIO:%d\n", e->flags, e->priority);
+    print_usdn_match(usdn_fts_match(e));
+    print_usdn_action(usdn_fts_action(e));
+    e = (usdn_fts_entry_t *)((uint8_t *)e + usdn_fts_entry_length(e));
+  }
 }
 
 
@@ -172,7 +225,8 @@ print_usdn_nsu(usdn_nsu_t *nsu)
 {
   int i;
   usdn_nsu_link_t *link;
-  printf("nsu[cfg:%d, r:%d nl:%d", nsu->cfg_id, nsu->rank, nsu->num_links);
+  printf("nsu[cfg:%d, r:%d ev:%d seq:%d f:%x nl:%d", nsu->cfg_id, nsu->rank,
+         nsu->ft_evicted, nsu->seq, nsu->flags, nsu->num_links);
   if(nsu->num_links > 0) {
     for(i = 0; i < nsu->num_links; i++) {
       link = &nsu->links[i];
@@ -204,59 +258,183 @@ usdn_engine_mac_callback(void *data, int status)
 /*---------------------------------------------------------------------------*/
 /* Message Handling In */
 /*---------------------------------------------------------------------------*/
+/* We don't send anything that needs an ack from the controller, so just note
+   them */
 static void
 cack_input(void *data)
 {
   LOG_DBG("Parsing CACK...\n");
-
-  /* TODO: usdn CACK */
-
+  LOG_STAT("CACK id:%u\n", ((usdn_hdr_t *)data)->flow);
 }
 
 static void
 cnack_input(void *data)
 {
   LOG_DBG("Parsing CNACK...\n");
+  LOG_WARN("CNACK id:%u\n", ((usdn_hdr_t *)data)->flow);
+}
+
+/*---------------------------------------------------------------------------*/
+/* How long to drop packets the controller has no route for */
+static clock_time_t
+no_route_lifetime(usdn_match_t *m)
+{
+#if SDN_CONF_NO_ROUTE_TABLE_LEN
+  no_route_t *r;
+  uint8_t len = sdn_ft_match_data_len(m);
+
+  for(r = list_head(no_route_list); r != NULL; r = list_item_next(r)) {
+    if(r->index == m->index && r->len == len &&
+       memcmp(r->key, m->data, len) == 0) {
+      break;
+    }
+  }
+  if(r != NULL && !timer_expired(&r->window)) {
+    /* Still no route since last time, back off */
+    if(r->lifetime < SDN_CONF_NO_ROUTE_MAX_LIFETIME / 2) {
+      r->lifetime *= 2;
+    } else {
+      r->lifetime = SDN_CONF_NO_ROUTE_MAX_LIFETIME;
+    }
+    list_remove(no_route_list, r);
+  } else {
+    if(r != NULL) {
+      list_remove(no_route_list, r);
+    } else if((r = memb_alloc(&no_route_memb)) == NULL) {
+      /* Forget the one we heard about longest ago */
+      r = list_chop(no_route_list);
+    }
+    r->index = m->index;
+    r->len = len;
+    memcpy(r->key, m->data, len);
+    r->lifetime = SDN_CONF_NO_ROUTE_LIFETIME;
+  }
+  /* Most recent first */
+  list_push(no_route_list, r);
+  timer_set(&r->window, r->lifetime * 2);
+  return r->lifetime;
+#else
+  return SDN_CONF_NO_ROUTE_LIFETIME;
+#endif /* SDN_CONF_NO_ROUTE_TABLE_LEN */
+}
 
-  /* TODO: usdn CNACK */
+/*---------------------------------------------------------------------------*/
+/* Length of the FTS entry at ptr, or 0 if it runs past end */
+static uint8_t
+fts_entry_length(uint8_t *ptr, uint8_t *end)
+{
+  usdn_fts_entry_t *e = (usdn_fts_entry_t *)ptr;
+  usdn_action_t *a;
 
+  /* Check each header is there before we read its length */
+  if(ptr + sizeof(usdn_fts_entry_t) + sizeof(usdn_match_t) > end ||
+     (uint8_t *)usdn_fts_action(e) + sizeof(usdn_action_t) > end) {
+    return 0;
+  }
+  a = usdn_fts_action(e);
+  if(a->data + a->len > end) {
+    return 0;
+  }
+  return usdn_fts_entry_length(e);
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+fts_entry_input(usdn_fts_entry_t *e)
+{
+  usdn_match_t *fm = usdn_fts_match(e);
+  usdn_action_t *fa = usdn_fts_action(e);
+
+  if(sdn_ft_match_data_len(fm) > USDN_CONF_MAX_FTS_DATA) {
+    LOG_ERR("FTS match is too long (%u)\n", fm->len);
+    return;
+  }
+  /* The controller answers repeated queries with the same FTS. Building the
+     rules for one could evict a live entry from a full table, so check
+     first */
+  {
+    sdn_ft_match_rule_t cm = { fm->operator, fm->index, fm->len, fm->req_ext,
+                               0, fm->data, NULL };
+    sdn_ft_action_rule_t ca = { fa->action, fa->index, fa->len, fa->data,
+                                NULL, NULL };
+    if(sdn_ft_entry_exists(&cm, &ca)) {
+      LOG_DBG("FTS entry is already in the flowtable\n");
+      return;
+    }
+  }
+  /* Create the actual entry in the table */
+  sdn_ft_match_rule_t *m = sdn_ft_create_match(fm->operator,
+                                               fm->index,
+                                               fm->len,
+                                               fm->req_ext,
+                                               fm->data);
+  sdn_ft_action_rule_t *a = sdn_ft_create_action(fa->action,
+                                                 fa->index,
+                                                 fa->len,
+                                                 fa->data);
+  if(e->flags & USDN_FTS_NO_ROUTE) {
+    /* Drop for a while rather than asking again for every packet */
+    clock_time_t lifetime = no_route_lifetime(fm);
+    sdn_ft_entry_t *ft_e = sdn_ft_create_entry_priority(FLOWTABLE, m, a,
+                                                        lifetime, 0,
+                                                        e->priority);
+    LOG_INFO("FTS no route, dropping for %lu ticks\n",
+             (unsigned long)lifetime);
+    if(ft_e != NULL) {
+      ft_e->hard = 1;
+    }
+  } else {
+    sdn_ft_create_entry_priority(FLOWTABLE, m, a, SDN_CONF.ft_lifetime,
+                                 e->flags & USDN_FTS_DEFAULT, e->priority);
+  }
 }
 
 /*---------------------------------------------------------------------------*/
 // FIXME: This works, HOWEVER, it's not really something that should be done
 //        in the engine.  We should really be creating the table entries in the
 //        driver. The FTS should be using the driver API to set FT entries.
-static void
-fts_input(void *data) {
+static uint8_t
+fts_input(void *data, uint8_t length) {
   usdn_fts_t *fts = (usdn_fts_t *)data;
+  uint8_t *ptr, *end = (uint8_t *)data + length;
+  uint8_t i, len;
 
   LOG_DBG("Parsing FTSET...\n");
-  /* Create the actual entry in the table */
-  sdn_ft_match_rule_t *m = sdn_ft_create_match(fts->m.operator,
-                                               fts->m.index,
-                                               fts->m.len,
-                                               fts->m.req_ext,
-                                               &fts->m.data);
-  sdn_ft_action_rule_t *a = sdn_ft_create_action(fts->a.action,
-                                                 fts->a.index,
-                                                 fts->a.len,
-                                                 &fts->a.data);
-  sdn_ft_create_entry(FLOWTABLE, m, a, SDN_CONF.ft_lifetime, fts->is_default);
+  if(length < sizeof(usdn_fts_t)) {
+    LOG_ERR("FTS is too short (%u)\n", length);
+    return 0;
+  }
+  ptr = fts->entries;
+  for(i = 0; i < fts->num_entries; i++) {
+    if((len = fts_entry_length(ptr, end)) == 0) {
+      LOG_ERR("FTS entry %u is cut short\n", i);
+      return 0;
+    }
+    fts_entry_input((usdn_fts_entry_t *)ptr);
+    ptr += len;
+  }
 
   // print_usdn_fts(fts);
 
 #if SDN_CONF_RETRY_AFTER_QUERY
-  /* Check for a buffered packet */
-  LOG_DBG("Retry buffered packet with tx_id: %d\n", fts->tx_id);
-  SDN_DRIVER.retry(fts->tx_id);
+  /* Check for a buffered packet, if this was for one of our queries */
+  if(fts->flags & USDN_FTS_REPLY) {
+    LOG_DBG("Retry buffered packet with tx_id: %d\n", fts->tx_id);
+    SDN_DRIVER.retry(fts->tx_id);
+  }
 #endif
+  return 1;
 }
 
 /*---------------------------------------------------------------------------*/
-static void
-cfg_input(void *data) {
+static uint8_t
+cfg_input(void *data, uint8_t length) {
   usdn_cfg_t *cfg = (usdn_cfg_t *)data;
   LOG_DBG("Setting SDN Configuration...\n");
+  if(length < sizeof(usdn_cfg_t)) {
+    LOG_ERR("CFG is too short (%u)\n", length);
+    return 0;
+  }
 
 #if WITH_SDN_STATS
   /* We have been configured */
@@ -288,8 +466,13 @@ cfg_input(void *data) {
     sdn_cd_set_state(CTRL_CONNECTED, DEFAULT_CONTROLLER);
   }
 
+  /* The controller may have lost our links (e.g. it restarted), so send it
+     all of them */
+  nsu_to_full = 0;
+
   /* Immediately update/ack the controller (to say we have been configured) */
   SDN_ENGINE.controller_update(SDN_TMR_STATE_IMMEDIATE);
+  return 1;
 }
 /*---------------------------------------------------------------------------*/
 /* Message Handling Out */
@@ -315,7 +498,7 @@ send(sdn_controller_t *c, uint8_t length, void *data)
 
 /*---------------------------------------------------------------------------*/
 static usdn_hdr_t *
-set_header(void *buf, uint8_t net, uint8_t type, uint8_t flow)
+set_header(void *buf, uint8_t net, uint8_t type, uint16_t flow)
 {
   usdn_hdr_t *hdr = (usdn_hdr_t *)buf;
   hdr->net = net;
@@ -325,11 +508,27 @@ set_header(void *buf, uint8_t net, uint8_t type, uint8_t flow)
   return hdr;
 }
 
+/*---------------------------------------------------------------------------*/
+/* Whether we still have a neighbor with this id */
+static uint8_t
+nbr_id_exists(sdn_node_id_t id)
+{
+  uip_ds6_nbr_t *nbr;
+  for(nbr = nbr_table_head(ds6_neighbors); nbr != NULL;
+      nbr = nbr_table_next(ds6_neighbors, nbr)) {
+    if(sdn_node_id_from_ipaddr(&nbr->ipaddr) == id) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 /*---------------------------------------------------------------------------*/
 static usdn_nsu_t *
-nsu_output(void *buf)
+nsu_output(void *buf, uint8_t full)
 {
-  uint8_t i;
+  uint8_t i, n;
+  int16_t diff;
   usdn_nsu_t      *nsu;
   uip_ds6_nbr_t   *nbr;
   usdn_nsu_link_t link;
@@ -338,33 +537,84 @@ nsu_output(void *buf)
 
   /* Set node information */
   nsu->cfg_id = SDN_CONF.cfg_id;
+  nsu->ft_evicted = ft_evicted;
   rpl_dag_t *dag = rpl_get_any_dag();
   if(dag != NULL) {
       nsu->rank = DAG_RANK(dag->rank, dag->instance) - 1;
   }
+  nsu->seq = nsu_seq++;
+
+  /* A full NSU tells the controller about every link afresh */
+  if(full || (!nsu_resync && nsu_to_full == 0)) {
+    nsu->flags = USDN_NSU_FULL;
+    nsu_sent_len = 0;
+    nsu_to_full = SDN_CONF_NSU_FULL_PERIOD - 1;
+  } else if(nsu_resync) {
+    /* The links that didn't fit in the last part. The controller only
+       prunes links once it has all of them */
+    nsu->flags = USDN_NSU_FULL;
+  } else {
+    nsu->flags = 0;
+    nsu_to_full--;
+  }
 
-  /* Set link information, itterating over all neighbours */
-  i = 0;
+  /* Set link information for new links, and those that have changed enough.
+     Any that don't fit are sent next time */
+  n = 0;
   nbr = nbr_table_head(ds6_neighbors);
-  while(nbr != NULL) {
+  while(nbr != NULL && n < NSU_MAX_LINKS) {
     /* Neighbor stats */
     link.nbr_id = sdn_node_id_from_ipaddr(&nbr->ipaddr);
     /* Link stats */
     const struct link_stats *stats = sdn_get_nbr_link_stats(nbr);
     link.rssi = stats->rssi;
-    memcpy(&nsu->links->rssi, &link.rssi, sizeof(int16_t));
     // link.etx = stats->etx;
-    // memcpy(&nsu->links->etx, &link.etx, sizeof(int16_t));
     // link.is_fresh = sdn_get_nbr_link_is_fresh(nbr);
-    /* Copy the link into the buffer */
-    memcpy(&nsu->links[i], &link, sizeof(usdn_nsu_link_t));
+    for(i = 0; i < nsu_sent_len && nsu_sent[i].nbr_id != link.nbr_id; i++);
+    diff = i < nsu_sent_len ? link.rssi - nsu_sent[i].rssi : 0;
+    if(i == nsu_sent_len || diff >= SDN_CONF_NSU_RSSI_HYSTERESIS ||
+       -diff >= SDN_CONF_NSU_RSSI_HYSTERESIS) {
+      if(i == nsu_sent_len && nsu_sent_len < NBR_TABLE_MAX_NEIGHBORS) {
+        nsu_sent_len++;
+      }
+      if(i < nsu_sent_len) {
+        nsu_sent[i] = link;
+      }
+      /* Copy the link into the buffer */
+      memcpy(&nsu->links[n++], &link, sizeof(usdn_nsu_link_t));
+    }
     /* Move on to next neighbor link */
     nbr = nbr_table_next(ds6_neighbors, nbr);
-    i++;
+  }
+
+  /* If any neighbors we haven't sent didn't fit, a full NSU goes in parts */
+  nsu_resync = 0;
+  if(nsu->flags & USDN_NSU_FULL) {
+    for(; nbr != NULL && !nsu_resync; nbr = nbr_table_next(ds6_neighbors, nbr)) {
+      link.nbr_id = sdn_node_id_from_ipaddr(&nbr->ipaddr);
+      for(i = 0; i < nsu_sent_len && nsu_sent[i].nbr_id != link.nbr_id; i++);
+      nsu_resync = i == nsu_sent_len && nsu_sent_len < NBR_TABLE_MAX_NEIGHBORS;
+    }
+    if(nsu_resync) {
+      nsu->flags |= USDN_NSU_MORE;
+    }
+  }
+
+  /* Tell the controller about links we no longer have */
+  i = 0;
+  while(i < nsu_sent_len && n < NSU_MAX_LINKS) {
+    if(nbr_id_exists(nsu_sent[i].nbr_id)) {
+      i++;
+      continue;
+    }
+    link.nbr_id = nsu_sent[i].nbr_id;
+    link.rssi = USDN_NSU_RSSI_REMOVED;
+    memcpy(&nsu->links[n++], &link, sizeof(usdn_nsu_link_t));
+    nsu_sent[i] = nsu_sent[--nsu_sent_len];
   }
 
   /* Set total number of links */
-  nsu->num_links = i;
+  nsu->num_links = n;
 
   /* Return the payload length */
   return nsu;
@@ -372,9 +622,14 @@ nsu_output(void *buf)
 
 /*---------------------------------------------------------------------------*/
 static usdn_ftq_t *
-ftq_output(void *buf, uint8_t tx_id, uint16_t datalen, void *data)
+ftq_output(void *buf, uint16_t tx_id, uint16_t datalen, void *data)
 {
   usdn_ftq_t *ftq = (usdn_ftq_t *)buf;
+  /* Don't run off the end of the buffer */
+  if(datalen > sizeof(databuf) - USDN_H_LEN - sizeof(usdn_ftq_t)) {
+    LOG_ERR("FTQ data is too long (%u), truncating\n", datalen);
+    datalen = sizeof(databuf) - USDN_H_LEN - sizeof(usdn_ftq_t);
+  }
   /* Set FTQ */
   ftq->tx_id = tx_id;
   ftq->index = 0;
@@ -389,7 +644,12 @@ static usdn_nsu_t *
 cjoin_output(void *buf)
 {
   /* Currently a CJOIN is essentially a NSU with a different header... */
-  return nsu_output(buf);
+  usdn_nsu_t *nsu = nsu_output(buf, 1);
+  /* ...but the controller doesn't take links from it, so start our NSUs
+     with a full one */
+  nsu_to_full = 0;
+  nsu_resync = 0;
+  return nsu;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -416,6 +676,55 @@ handle_join_timer(void *ptr)
   }
 }
 
+/*---------------------------------------------------------------------------*/
+#if SDN_CONF_NSU_AGGREGATE_WINDOW
+static void
+agg_flush(void *ptr)
+{
+  ctimer_stop(&agg_timer);
+  if(agg_len > 0) {
+    set_header(aggbuf,
+               SDN_CONF.sdn_net,
+               USDN_MSG_CODE_NSU_AGG,
+               nsu_count++);
+    send(DEFAULT_CONTROLLER, USDN_H_LEN + agg_len, aggbuf);
+    agg_len = 0;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Hold a node's NSU as a record (iid != NULL), or records that are already
+   aggregated. Sends what we were holding if there isn't room */
+static uint8_t
+agg_hold(uint8_t *iid, void *data, uint8_t length)
+{
+  int rec_len = length + (iid != NULL ? USDN_NSU_IID_LEN : 0);
+
+  if(agg_len + rec_len > SDN_CONF_NSU_AGGREGATE_LEN) {
+    agg_flush(NULL);
+    if(rec_len > SDN_CONF_NSU_AGGREGATE_LEN) {
+      return 0;
+    }
+  }
+  if(iid != NULL) {
+    memcpy(AGG_PAYLOAD + agg_len, iid, USDN_NSU_IID_LEN);
+    agg_len += USDN_NSU_IID_LEN;
+  }
+  memcpy(AGG_PAYLOAD + agg_len, data, length);
+  agg_len += length;
+  return 1;
+}
+#endif /* SDN_CONF_NSU_AGGREGATE_WINDOW */
+
+/*---------------------------------------------------------------------------*/
+#if SDN_CONF_NSU_TRICKLE_DOUBLINGS
+static void
+handle_nsu_changed(void *ptr)
+{
+  SDN_ENGINE.controller_update(SDN_TMR_STATE_RESET);
+}
+#endif /* SDN_CONF_NSU_TRICKLE_DOUBLINGS */
+
 /*---------------------------------------------------------------------------*/
 static void
 handle_update_timer(void *ptr)
@@ -429,39 +738,114 @@ handle_update_timer(void *ptr)
                SDN_CONF.sdn_net,
                USDN_MSG_CODE_NSU,
                nsu_count++);
-    usdn_nsu_t *nsu = nsu_output(USDN_BUF_PAYLOAD);
+    usdn_nsu_t *nsu = nsu_output(USDN_BUF_PAYLOAD, 0);
 
     // print_usdn_header(hdr);
     // print_usdn_nsu(nsu);
     // LOG_DBG("NSU Length: %d, Send Length:%d\n", nsu_length(nsu), USDN_H_LEN + nsu_length(nsu));
 
     uint8_t packet_length = USDN_H_LEN + nsu_length(nsu);
+#if SDN_CONF_NSU_AGGREGATE_WINDOW
+    /* Take any NSUs we're holding along with ours */
+    uip_ipaddr_t src;
+    uip_ds6_select_src(&src, &c->ipaddr);
+    if(agg_len > 0 && agg_hold(&src.u8[8], nsu, nsu_length(nsu))) {
+      agg_flush(NULL);
+    } else {
+      send(c, packet_length, USDN_BUF);
+    }
+#else
     send(c, packet_length, USDN_BUF);
+#endif /* SDN_CONF_NSU_AGGREGATE_WINDOW */
+    ft_evicted = 0;
     /* If the conf has set the period to 0 then turn off updates */
     if (c->update_period == 0) {
       SDN_ENGINE.controller_update(SDN_TMR_STATE_STOP);
+    } else if(nsu->flags & USDN_NSU_MORE) {
+      /* Send the rest of the full update soon, not a period later */
+      ctimer_set(&c->update_timer, 1 + SDN_RANDOM_NSU_DELAY(),
+                 handle_update_timer, c);
     } else {
+#if SDN_CONF_NSU_TRICKLE_DOUBLINGS
+      /* Links have come, gone, or changed RSSI since the last NSU. The trickle
+         timer reschedules itself once we return, so reset it afterwards */
+      if(!(nsu->flags & USDN_NSU_FULL) && nsu->num_links > 0) {
+        ctimer_set(&c->update_timer, 0, handle_nsu_changed, c);
+      }
+#else
       SDN_ENGINE.controller_update(SDN_TMR_STATE_RESET);
+#endif
     }
   } else {
     LOG_ERR("NSU No controller to send to!");
   }
 }
 
+#if SDN_CONF_NSU_TRICKLE_DOUBLINGS
+/*---------------------------------------------------------------------------*/
+static void
+handle_nsu_trickle(void *ptr, uint8_t suppress)
+{
+  handle_update_timer(ptr);
+}
+#endif /* SDN_CONF_NSU_TRICKLE_DOUBLINGS */
+
 /*---------------------------------------------------------------------------*/
 /* SDN Engine Implementation */
+/*---------------------------------------------------------------------------*/
+static void
+ft_evict_callback(sdn_ft_entry_t *e)
+{
+  /* Reported in the next NSU */
+  if(ft_evicted < 0xFF) {
+    ft_evicted++;
+  }
+}
+
 /*---------------------------------------------------------------------------*/
 static void
 init(void)
 {
-  /* TODO */
+  sdn_ft_register_evict_handler(ft_evict_callback);
+#if SDN_CONF_NO_ROUTE_TABLE_LEN
+  memb_init(&no_route_memb);
+  list_init(no_route_list);
+#endif /* SDN_CONF_NO_ROUTE_TABLE_LEN */
+}
+
+/*---------------------------------------------------------------------------*/
+#if SDN_CONF_ACK_CONTROLLER
+/* Whether we've already applied this message from the controller */
+static uint8_t
+rx_flow_seen(uint16_t flow)
+{
+  uint8_t i;
+  for(i = 0; i < SDN_CONF_ACK_CONTROLLER; i++) {
+    if(rx_flows[i] == flow) {
+      return 1;
+    }
+  }
+  rx_flows[rx_flows_idx] = flow;
+  rx_flows_idx = (rx_flows_idx + 1) % SDN_CONF_ACK_CONTROLLER;
+  return 0;
 }
 
+/*---------------------------------------------------------------------------*/
+static void
+ack_output(sdn_controller_t *c, uint16_t flow, uint8_t ok)
+{
+  set_header(USDN_BUF, SDN_CONF.sdn_net,
+             ok ? USDN_MSG_CODE_CACK : USDN_MSG_CODE_CNACK, flow);
+  send(c, USDN_H_LEN, USDN_BUF);
+}
+#endif /* SDN_CONF_ACK_CONTROLLER */
+
 /*---------------------------------------------------------------------------*/
 static void
 in(void *data, uint8_t length, void *ptr)
 {
   usdn_hdr_t *hdr = (usdn_hdr_t *)data;
+  uint8_t ok;
   /* IN type src txid hops */
   LOG_STAT("IN %s s:%d d:%d id:%d h:%d\n",
             USDN_CODE_STRING(hdr->typ),
@@ -479,10 +863,29 @@ in(void *data, uint8_t length, void *ptr)
       cnack_input(data);
       break;
     case USDN_MSG_CODE_FTS:
-      fts_input(data + USDN_H_LEN);
-      break;
     case USDN_MSG_CODE_CFG:
-      cfg_input(data + USDN_H_LEN);
+#if SDN_CONF_ACK_CONTROLLER
+      /* The controller sends these until we ack them. Messages from a
+         controller on this node (ptr is NULL) aren't acked */
+      if(ptr != NULL && hdr->flow != 0 && rx_flow_seen(hdr->flow)) {
+        LOG_DBG("Already have %s id:%u\n", USDN_CODE_STRING(hdr->typ), hdr->flow);
+        ack_output((sdn_controller_t *)ptr, hdr->flow, 1);
+        break;
+      }
+#endif /* SDN_CONF_ACK_CONTROLLER */
+      if(hdr->typ == USDN_MSG_CODE_FTS) {
+        ok = fts_input(data + USDN_H_LEN, length - USDN_H_LEN);
+      } else {
+        ok = cfg_input(data + USDN_H_LEN, length - USDN_H_LEN);
+      }
+      if(!ok) {
+        LOG_WARN("Couldn't use %s id:%u\n", USDN_CODE_STRING(hdr->typ), hdr->flow);
+      }
+#if SDN_CONF_ACK_CONTROLLER
+      if(ptr != NULL) {
+        ack_output((sdn_controller_t *)ptr, hdr->flow, ok);
+      }
+#endif /* SDN_CONF_ACK_CONTROLLER */
       break;
     default:
       LOG_ERR("IN Unknown message type!");
@@ -525,11 +928,49 @@ static void
 controller_update(sdn_tmr_state_t state)
 {
   sdn_controller_t *c = DEFAULT_CONTROLLER;
+#if SDN_CONF_NSU_TRICKLE_DOUBLINGS
+  clock_time_t i_min;
+#else
   int period;
+#endif
 
   LOG_DBG("Set NSU timer (%s)...\n", SDN_TIMER_STRING(state));
   if(c != NULL) { /* Defensive coding */
     switch(state) {
+#if SDN_CONF_NSU_TRICKLE_DOUBLINGS
+      case SDN_TMR_STATE_STOP:
+        trickle_timer_stop(&nsu_trickle);
+        ctimer_stop(&c->update_timer);
+        break;
+      case SDN_TMR_STATE_START:
+        if(!c->update_period) {
+          LOG_ERR("Update period is 0, not setting NSU");
+          break;
+        }
+        /* The update period is the longest we'll go without an NSU */
+        i_min = ((uint32_t)c->update_period * CLOCK_SECOND)
+                >> SDN_CONF_NSU_TRICKLE_DOUBLINGS;
+        if(i_min < 2) {
+          i_min = 2;
+        }
+        if(trickle_timer_is_running(&nsu_trickle) &&
+           nsu_trickle.i_min == i_min) {
+          /* Already running, don't lose our backoff */
+          break;
+        }
+        LOG_DBG("Setting NSU trickle Imin %lu ticks\n", (unsigned long)i_min);
+        /* We never hear other NSUs, so k only needs to be nonzero */
+        trickle_timer_config(&nsu_trickle, i_min,
+                             SDN_CONF_NSU_TRICKLE_DOUBLINGS, 1);
+        trickle_timer_set(&nsu_trickle, handle_nsu_trickle, c);
+        break;
+      case SDN_TMR_STATE_RESET:
+        /* Our neighbourhood has changed, back to Imin */
+        if(trickle_timer_is_running(&nsu_trickle)) {
+          trickle_timer_inconsistency(&nsu_trickle);
+        }
+        break;
+#else
       case SDN_TMR_STATE_STOP:
         ctimer_stop(&c->update_timer);
         break;
@@ -543,6 +984,7 @@ controller_update(sdn_tmr_state_t state)
           ctimer_set(&c->update_timer, period, handle_update_timer, c);
         }
         break;
+#endif /* SDN_CONF_NSU_TRICKLE_DOUBLINGS */
       case SDN_TMR_STATE_IMMEDIATE:
         handle_update_timer(c);
         break;
@@ -561,7 +1003,8 @@ controller_query(void *data)
   sdn_controller_t *c = DEFAULT_CONTROLLER;
   sdn_bufpkt_t *p = (sdn_bufpkt_t *)data;
 
-  // FIXME: There is a bit of confusion between flows and tx_id
+  /* The header flow numbers our ftqs, the tx_id is the buffered packet's id
+     that the controller replies to (FTS) */
   LOG_DBG("QUERY Send query with tx_id (%d)\n", p->id);
 
   if(c != NULL) {
@@ -570,7 +1013,7 @@ controller_query(void *data)
                USDN_MSG_CODE_FTQ,
                ++ftq_count);
     usdn_ftq_t *ftq = ftq_output(USDN_BUF_PAYLOAD,
-                                 p->id, p->buf_len, &p->packet_buf);
+                                 p->id, p->buf_len, p->packet_buf);
     // print_usdn_ftq(ftq);
     // LOG_DBG("FTQ Length: %d, Send Length:%d\n",
     //        ftq_length(ftq), USDN_H_LEN + ftq_length(ftq));
@@ -602,6 +1045,54 @@ controller_query_data(void *data, uint8_t len)
   }
 }
 
+/*---------------------------------------------------------------------------*/
+static uint8_t
+controller_forward(void)
+{
+#if SDN_CONF_NSU_AGGREGATE_WINDOW
+  sdn_controller_t *c = DEFAULT_CONTROLLER;
+  usdn_hdr_t *hdr = (usdn_hdr_t *)&uip_buf[uip_l2_l3_udp_hdr_len];
+  usdn_nsu_t *nsu = (usdn_nsu_t *)&uip_buf[uip_l2_l3_udp_sdn_hdr_len];
+  int length = uip_len - UIP_IPUDPH_LEN - uip_ext_len - USDN_H_LEN;
+  udp_data_t udp_info;
+  uint8_t held;
+
+  /* Only uSDN messages to the controller's port */
+  memcpy(&udp_info, &c->conn_data, sizeof(udp_data_t));
+  if(UIP_UDP_BUF->destport != UIP_HTONS(udp_info.lport) ||
+     length < (int)sizeof(usdn_nsu_t) || length > SDN_CONF_NSU_AGGREGATE_LEN) {
+    return 0;
+  }
+
+  switch(hdr->typ) {
+    case USDN_MSG_CODE_NSU:
+      if(length != nsu_length(nsu)) {
+        return 0;
+      }
+      held = agg_hold(&UIP_IP_BUF->srcipaddr.u8[8], nsu, length);
+      break;
+    case USDN_MSG_CODE_NSU_AGG:
+      held = agg_hold(NULL, nsu, length);
+      break;
+    default:
+      return 0;
+  }
+
+  if(held) {
+    LOG_DBG("NSU Holding %s from %d (%d bytes held)\n",
+            USDN_CODE_STRING(hdr->typ),
+            UIP_IP_BUF->srcipaddr.u8[sizeof(uip_ipaddr_t) - 1], agg_len);
+    /* Don't hold them for longer than the window */
+    if(ctimer_expired(&agg_timer)) {
+      ctimer_set(&agg_timer, SDN_CONF_NSU_AGGREGATE_WINDOW, agg_flush, NULL);
+    }
+  }
+  return held;
+#else
+  return 0;
+#endif /* SDN_CONF_NSU_AGGREGATE_WINDOW */
+}
+
 /*---------------------------------------------------------------------------*/
 /* Engine API */
 /*---------------------------------------------------------------------------*/
@@ -610,5 +1101,6 @@ const struct sdn_engine usdn_engine = {
   in,
   controller_join,
   controller_update,
-  controller_query
+  controller_query,
+  controller_forward
 };
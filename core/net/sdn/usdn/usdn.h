@@ -56,6 +56,7 @@ typedef enum USDN_CODE {
   USDN_MSG_CODE_FTS,
   USDN_MSG_CODE_TRACKRQ,
   USDN_MSG_CODE_DATA,
+  USDN_MSG_CODE_NSU_AGG,
 } usdn_msg_code_t;
 
 #define USDN_CODE_STRING(code) \
@@ -67,7 +68,8 @@ typedef enum USDN_CODE {
   (code == USDN_MSG_CODE_FTQ) ? ("FTQ") : \
   (code == USDN_MSG_CODE_FTS) ? ("FTS") : \
   (code == USDN_MSG_CODE_TRACKRQ) ? ("TR") : \
-  (code == USDN_MSG_CODE_DATA) ? ("DATA") : "UNKNOWN")
+  (code == USDN_MSG_CODE_DATA) ? ("DATA") : \
+  (code == USDN_MSG_CODE_NSU_AGG) ? ("NSUA") : "UNKNOWN")
 
 /* Offset values for various uSDN header fields */
 #define USDN_HDR_NET_OFFSET  0
@@ -92,10 +94,23 @@ typedef struct usdn_nsu_link {
   // uint8_t       is_fresh;
 } usdn_nsu_link_t;
 
+/* A link in a delta NSU with this rssi has gone */
+#define USDN_NSU_RSSI_REMOVED 0x7FFF
+
+/* NSU flags */
+#define USDN_NSU_FULL         0x01    /* links is every link the node has,
+                                         rather than changes since the last */
+#define USDN_NSU_MORE         0x02    /* a full NSU whose links didn't all
+                                         fit, the rest follow in the next
+                                         NSUs. The last part doesn't have it */
+
 typedef struct usdn_nsu {
   /* Node Info */
   uint8_t         cfg_id;
   uint8_t         rank;
+  uint8_t         ft_evicted;   /* Flowtable entries evicted since last NSU */
+  uint8_t         seq;          /* One more than the last NSU's */
+  uint8_t         flags;        /* USDN_NSU_x */
   /* Link Info */
   uint8_t         num_links;
   usdn_nsu_link_t links[];
@@ -103,6 +118,16 @@ typedef struct usdn_nsu {
 #define nsu_length(nsu) sizeof(usdn_nsu_t) + \
                         (sizeof(usdn_nsu_link_t) * nsu->num_links)
 
+/* An aggregated NSU (USDN_MSG_CODE_NSU_AGG) is a number of these back to back,
+   from the sender and the nodes below it */
+#define USDN_NSU_IID_LEN      8
+typedef struct usdn_nsu_rec {
+  uint8_t         iid[USDN_NSU_IID_LEN]; /* Node's interface id. It has the
+                                            same prefix as the sender */
+  usdn_nsu_t      nsu;
+} usdn_nsu_rec_t;
+#define nsu_rec_length(rec) (USDN_NSU_IID_LEN + nsu_length((&(rec)->nsu)))
+
 /*---------------------------------------------------------------------------*/
 /* Logical Representation of uSDN Controller Join */
 
@@ -110,34 +135,55 @@ typedef struct usdn_nsu {
 
 /*---------------------------------------------------------------------------*/
 /* Logical Representation of uSDN Flowtable Set */
-// TODO: Make this user configurable
+/* Longest match data (including any mask) we'll take in an FTS */
+#ifndef USDN_CONF_MAX_FTS_DATA
 #define USDN_CONF_MAX_FTS_DATA 20
+#endif
 
+/* Matches and actions are sent with only as much data as they use */
 typedef struct usdn_match {
   sdn_ft_match_op_t     operator;      /**< ==, !=, <= etc... */
   uint8_t               index;         /**< field index within uip_buf */
   uint8_t               len;           /**< length of the field in uip_buf */
   uint8_t               req_ext;       /**< requires ext_header_len */
-  uint8_t               data[USDN_CONF_MAX_FTS_DATA];
+  uint8_t               data[];        /**< MASK: value, mask */
 } usdn_match_t;
+#define usdn_match_length(m) (sizeof(usdn_match_t) + sdn_ft_match_data_len(m))
 
 typedef struct usdn_action {
   sdn_ft_action_type_t  action;       /**< action to perform */
   uint8_t               index;        /**< (optional) index in uip_buf */
   uint8_t               len;          /**< (optional) length in uip_buf */
-  uint8_t               data[USDN_CONF_MAX_FTS_DATA];
+  uint8_t               data[];
 } usdn_action_t;
+#define usdn_action_length(a) (sizeof(usdn_action_t) + (a)->len)
+
+/* FTS entry flags */
+#define USDN_FTS_DEFAULT      0x01     /* Set as the default entry */
+#define USDN_FTS_NO_ROUTE     0x02     /* Controller has no route for the
+                                          query, action is a drop */
+
+typedef struct usdn_fts_entry {
+  uint8_t               flags;         /* USDN_FTS_x */
+  uint8_t               priority;      /* SDN_FT_PRIORITY_x */
+  uint8_t               rules[];       /* usdn_match_t, then usdn_action_t */
+} usdn_fts_entry_t;
+#define usdn_fts_match(e)   ((usdn_match_t *)(e)->rules)
+#define usdn_fts_action(e)  ((usdn_action_t *)((e)->rules + \
+                             usdn_match_length(usdn_fts_match(e))))
+#define usdn_fts_entry_length(e) (sizeof(usdn_fts_entry_t) + \
+                             usdn_match_length(usdn_fts_match(e)) + \
+                             usdn_action_length(usdn_fts_action(e)))
+
+/* FTS message flags */
+#define USDN_FTS_REPLY        0x01     /* Answers the node's query tx_id */
 
 typedef struct usdn_ftset {
-  uint8_t               tx_id;
-  uint8_t               is_default;
-  usdn_match_t          m;
-  usdn_action_t         a;
+  uint16_t              tx_id;
+  uint8_t               flags;         /* USDN_FTS_REPLY */
+  uint8_t               num_entries;
+  uint8_t               entries[];     /* usdn_fts_entry_t, back to back */
 } usdn_fts_t;
-#define fts_length(fts) sizeof(fts->tx_id) + \
-                        sizeof(fts->is_default) + \
-                        sizeof(fts->m) + \
-                        sizeof(fts->a)
 
 /*---------------------------------------------------------------------------*/
 /* Logical Representation of uSDN Configure */
@@ -161,9 +207,9 @@ typedef struct usdn_cfg {
 /*---------------------------------------------------------------------------*/
 /* Logical Representation of uSDN Flowtable Query */
 typedef struct usdn_ftquery {
-  uint8_t  tx_id;
+  uint16_t tx_id;
   uint8_t  index;
-  uint16_t length;
+  uint8_t  length;
   uint8_t  data[];
 } usdn_ftq_t;
 #define ftq_length(ftq) sizeof(usdn_ftq_t) + ftq->length
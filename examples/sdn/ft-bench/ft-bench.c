@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2018, Toshiba Research Europe Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file is part of the Contiki operating system.
+ *
+ */
+/**
+ * \file
+ *         uSDN: Flowtable match benchmark (native only). Checks sdn_ft_do_match()
+ *         against a plain memcmp for every operator, then times typical matches.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "contiki.h"
+#include "lib/random.h"
+#include "net/ip/uip.h"
+
+#include "net/sdn/sdn.h"
+#include "net/sdn/sdn-ft.h"
+
+/* Matches timed for each rule, and random matches checked */
+#define BENCH_ROUNDS    10000000UL
+#define CHECK_ROUNDS    20000
+
+/* Packet, with room to move the fields onto an odd address */
+static uint8_t pkt[UIP_IPUDPH_LEN + 16] __attribute__((aligned(8)));
+
+PROCESS(ft_bench_process, "FT Bench");
+AUTOSTART_PROCESSES(&ft_bench_process);
+
+/*---------------------------------------------------------------------------*/
+/* What sdn_ft_do_match() should return, worked out the long way */
+static int
+reference(sdn_ft_match_op_t op, uint8_t *value, uint8_t *field, uint8_t len)
+{
+  uint8_t i;
+  int cmp;
+
+  if(op == MASK) {
+    for(i = 0; i < len; i++) {
+      if((field[i] & value[len + i]) != value[i]) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  cmp = memcmp(value, field, len);
+  switch(op) {
+    case EQ:
+      return cmp == 0;
+    case LT_EQ:
+      return cmp <= 0;
+    case GT_EQ:
+      return cmp >= 0;
+    case NOT_EQ:
+      return cmp != 0;
+    case LT:
+      return cmp < 0;
+    case GT:
+      return cmp > 0;
+    default:
+      return -1;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Random matches and packets, from few enough values that fields are often
+   equal. Returns the number that didn't agree with reference() */
+static unsigned long
+check(void)
+{
+  static const sdn_ft_match_op_t ops[] = { LT_EQ, LT, EQ, GT, GT_EQ, NOT_EQ,
+                                           MASK };
+  static const uint8_t lens[] = { 1, 2, 3, 4, sizeof(uip_ipaddr_t) };
+  uint8_t value[2 * sizeof(uip_ipaddr_t)];
+  sdn_ft_match_rule_t *m;
+  sdn_ft_match_op_t op;
+  unsigned long n, failed = 0;
+  uint8_t i, len, index, odd;
+
+  for(n = 0; n < CHECK_ROUNDS; n++) {
+    op = ops[random_rand() % (sizeof(ops) / sizeof(ops[0]))];
+    len = lens[random_rand() % sizeof(lens)];
+    for(i = 0; i < sizeof(value); i++) {
+      value[i] = random_rand() % 3;
+    }
+    if(op == MASK) {
+      /* The value is sent pre-masked */
+      for(i = 0; i < len; i++) {
+        value[i] &= value[len + i];
+      }
+    }
+    for(i = 0; i < sizeof(pkt); i++) {
+      pkt[i] = random_rand() % 3;
+    }
+    /* Addresses at their offsets in the IPv6 header, others in the UDP one */
+    index = len == sizeof(uip_ipaddr_t) ? 8 + (random_rand() % 2) * 16 :
+            UIP_IPH_LEN + random_rand() % 8;
+    m = sdn_ft_create_match(op, index, len, 0, value);
+    if(m == NULL) {
+      printf("FAILED to create a match\n");
+      return failed + 1;
+    }
+    /* Field as it was, then equal to the value, on even and odd addresses */
+    for(odd = 0; odd < 2; odd++) {
+      if(sdn_ft_do_match(m, pkt + odd, 0) !=
+         reference(op, value, pkt + odd + index, len)) {
+        failed++;
+      }
+    }
+    memcpy(pkt + index, value, len);
+    for(odd = 0; odd < 2; odd++) {
+      if(sdn_ft_do_match(m, pkt + odd, 0) !=
+         reference(op, value, pkt + odd + index, len)) {
+        failed++;
+      }
+    }
+    /* Frees m */
+    sdn_ft_chain_match(m, NULL);
+  }
+  return failed;
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+bench(const char *name, sdn_ft_match_rule_t *m)
+{
+  unsigned long n;
+  volatile int hits = 0;
+  clock_time_t start, ticks;
+
+  start = clock_time();
+  for(n = 0; n < BENCH_ROUNDS; n++) {
+    hits += sdn_ft_do_match(m, pkt, 0);
+  }
+  ticks = clock_time() - start;
+  /* In hundredths of a ns per match */
+  printf("%-24s %6llu.%02llu ns\n", name,
+         (unsigned long long)ticks * 100000000000ULL / CLOCK_SECOND /
+         BENCH_ROUNDS / 100,
+         (unsigned long long)ticks * 100000000000ULL / CLOCK_SECOND /
+         BENCH_ROUNDS % 100);
+  sdn_ft_chain_match(m, NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+PROCESS_THREAD(ft_bench_process, ev, data)
+{
+  static uint8_t addr[16] = { 0xfd, 0, 0, 0, 0, 0, 0, 0,
+                              0x02, 0x01, 0, 0x01, 0, 0x01, 0, 0x03 };
+  static uint8_t nh = UIP_PROTO_UDP;
+  static uint8_t port[2] = { 0x16, 0x2e };
+  unsigned long failed;
+
+  PROCESS_BEGIN();
+
+  sdn_ft_init();
+  printf("SDN_FT_SPECIALISE_MATCH %d\n", SDN_FT_SPECIALISE_MATCH);
+
+  failed = check();
+  printf("checked %d random matches, %lu wrong\n", CHECK_ROUNDS, failed);
+
+  /* A UDP packet to addr, except for the last byte of the interface id */
+  memset(pkt, 0, sizeof(pkt));
+  memcpy(pkt + 24, addr, sizeof(addr));
+  pkt[39] = 0x04;
+  pkt[6] = UIP_PROTO_UDP;
+  pkt[UIP_IPH_LEN] = 0x20;
+  bench("address EQ", sdn_ft_create_match(EQ, 24, 16, 0, addr));
+  bench("next header EQ", sdn_ft_create_match(EQ, 6, 1, 0, &nh));
+  bench("port LT_EQ", sdn_ft_create_match(LT_EQ, UIP_IPH_LEN, 2, 0, port));
+  bench("address NOT_EQ", sdn_ft_create_match(NOT_EQ, 8, 16, 0, addr));
+
+  exit(failed != 0);
+
+  PROCESS_END();
+}